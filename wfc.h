@@ -56,11 +56,194 @@
 // The output image will have the same number of components as the input
 // image.
 //
+// After a successful run, wfc_tiles gives the tile index of each cell
+// without a copy, and wfc_rasterize writes the output pixels into your
+// own buffer:
+//
+//         const int *tiles = wfc_tiles(wfc);  // owned by wfc
+//         wfc_rasterize(wfc, pixels, 0);      // 0 for tightly packed rows
+//
+// To change part of a finished output, wfc_regenerate_rect solves the
+// cells in a rectangle again so that they fit the cells around it. It
+// takes time in proportion to the rectangle, and returns 0, leaving the
+// output as it was, on a contradiction:
+//
+//         wfc_regenerate_rect(wfc, x, y, width, height);
+//
+// Cells can be pinned to tiles before wfc_run. wfc_constrain takes pairs
+// of cells and tiles, a cell listed several times may have any of its
+// tiles, and propagates all of them in one pass. The constrained cells
+// are kept by later wfc_init calls until wfc_clear_constraints:
+//
+//         int cells[] = { 0, 0, 5 };    // y * output_width + x
+//         int tiles[] = { 3, 4, 7 };    // cell 0 gets tile 3 or 4
+//         wfc_init(wfc);
+//         wfc_constrain(wfc, 3, cells, tiles);
+//         wfc_run(wfc, -1);
+//
 // wfc_run returns 0 if it cannot find a solution. You can try again like so:
 //
 //         wfc_init(wfc);
 //         wfc_run(wfc, -1);
 //
+// wfc_init seeds generation with the current time. Each wfc has its own
+// random number generator, so runs are reproducible with a fixed seed,
+// and separate wfc instances can be used from separate threads:
+//
+//         wfc_init_seed(wfc, 1234);
+//         wfc_run(wfc, -1);
+//
+// wfc_run_for runs for at most the given number of nanoseconds. It returns
+// WFC_RUN_STOPPED when the time is up, or when the flag set with
+// wfc_set_cancel becomes non-0, and the next call goes on from there:
+//
+//         int rv;
+//         while ((rv = wfc_run_for(wfc, 2000000)) == WFC_RUN_STOPPED)
+//           handle_other_requests();    // 2ms slices
+//         if (rv == WFC_RUN_FAILED)
+//           ...                         // Contradiction, wfc_init again
+//
+// Progress of the runs can be followed with a callback:
+//
+//         void progress(void *user_data, int collapsed_cell_cnt, int cell_cnt);
+//         wfc_set_progress(wfc, progress, user_data);
+//
+// With WFC_USE_STATS defined before including wfc.h, wfc_overlapping and
+// wfc_run count collapses, props and removed tiles and time their phases.
+// wfc_stats also reports the memory taken by cells, props and rules.
+// Without WFC_USE_STATS the counters are compiled out:
+//
+//         struct wfc_stats stats;
+//         wfc_stats(wfc, &stats);
+//         printf("%lld props in %lld ns\n", stats.prop_cnt, stats.propagate_ns);
+//
+// In the file with WFC_IMPLEMENTATION you can switch propagation to
+// support counters (AC-4), which is faster with many tiles but uses
+// cell_cnt * tile_cnt * 16 bytes more memory:
+//
+//         wfc->state->propagation = WFC_PROPAGATION_SUPPORT;
+//         wfc_init(wfc);
+//
+// Similarly, wfc->state->selection = WFC_SELECTION_SCAN finds the next cell
+// to collapse with a scan of all cells instead of the default min-heap.
+//
+// Operations on tile bitsets use AVX2, SSE2 or NEON when the compiler
+// targets them (e.g., with -mavx2). Define WFC_NO_SIMD next to
+// WFC_IMPLEMENTATION to use plain C instead.
+//
+// Instead of failing on a contradiction, wfc_run can backtrack: undo the
+// latest collapse, rule out the tile it picked and go on. Up to
+// max_backtrack_cnt backtracks are done before giving up, and only the
+// latest backtrack_depth collapses can be undone (0 means all of them):
+//
+//         wfc->state->max_backtrack_cnt = 1000;
+//         wfc->state->backtrack_depth = 256;
+//         wfc_init(wfc);
+//
+//
+// Generating many outputs from the same input
+// ----------------------------------------
+//
+// wfc_overlapping builds rules (a model) and a single solver state on top
+// of them. To generate many outputs, build the model once and create
+// a state per output. States don't modify the model, so they can run on
+// separate threads:
+//
+//         struct wfc_model *model = wfc_model_overlapping(
+//             input_image, 3, 3, 1, 1, 1, 1, 1);
+//
+//         struct wfc_state *state = wfc_state_create(model, 128, 128);
+//         wfc_state_init(state, seed);
+//         wfc_state_run(state, -1);
+//         struct wfc_image *output_image = wfc_state_output_image(state);
+//         wfc_state_destroy(state);
+//
+//         wfc_model_destroy(model);  // after all its states are destroyed
+//
+// wfc_run_batch does the above for n outputs on a pool of threads, each
+// thread reusing one state. Threads require pthreads and
+// WFC_USE_PTHREADS defined next to WFC_IMPLEMENTATION, otherwise outputs
+// are generated one after another:
+//
+//         struct wfc_image *outputs[16];
+//         wfc_run_batch(model, 128, 128, 16, seeds, 4, outputs);
+//         // outputs[i] is NULL if a contradiction occurred
+//
+// When only one output is needed but contradictions are frequent,
+// wfc_run_race runs attempts seeded seed, seed+1, ... on several threads
+// and returns the output of the first one that fully collapses, cancelling
+// the rest:
+//
+//         unsigned int winning_seed;
+//         struct wfc_image *output_image = wfc_run_race(
+//             model, 128, 128, seed, 64, 4, &winning_seed);
+//         // NULL if all 64 attempts ended with a contradiction
+//
+// For one large output, wfc_run_parallel cuts it into stripes and solves
+// them on several threads. Every other stripe is solved first, then the
+// stripes between them are fitted in:
+//
+//         struct wfc_image *output_image = wfc_run_parallel(
+//             model, 1024, 1024, seed, 8, 32);
+//         // NULL if a stripe failed all 8 of its seeds
+//
+// wfc_overlapping_hierarchical generates coarse to fine. The output is
+// first solved at 1/2^(level_cnt-1) of its size with rules from the input
+// downsampled as much, and each next level, twice as large, follows the
+// pixels of the one before. Levels are solved in windows of 64x64 cells,
+// so a contradiction only solves its window again. The input has to be
+// large enough to keep its features when downsampled:
+//
+//         struct wfc_image *output_image = wfc_overlapping_hierarchical(
+//             input_image, 3, 3, 1, 1, 1, 1, 4, 1024, 1024, 3, seed, 8);
+//         // 3 levels of 256x256, 512x512 and 1024x1024, 8 seeds per window
+//
+// Building the model can take a while for large inputs. wfc_model_save
+// stores it in a binary file under a key of the input image and the
+// parameters, and wfc_model_load returns NULL when the file is missing or
+// was saved for another input:
+//
+//         unsigned long long key = wfc_model_key(input_image, 3, 3, 1, 1, 1, 1);
+//         struct wfc_model *model = wfc_model_load("rules.wfcm", key);
+//         if (model == NULL) {
+//           model = wfc_model_overlapping(input_image, 3, 3, 1, 1, 1, 1, 4);
+//           wfc_model_save(model, key, "rules.wfcm");
+//         }
+//
+// Inputs with thousands of tiles usually allow few neighbours per tile.
+// Such models keep a sorted list of the allowed neighbours of each tile
+// instead of a bitset over all tiles, which is picked automatically.
+//
+// wfc_estimate_memory cuts the tiles and counts the rules without
+// allocating them, and reports the bytes the model and a state of the given
+// output size would take. wfc_model_overlapping_capped fails instead of
+// going over a memory cap, keeping the rules as lists when that fits, and
+// states of the model fail to be created, or use scan propagation, rather
+// than go over it:
+//
+//         struct wfc_memory memory;
+//         if (!wfc_estimate_memory(input_image, 3, 3, 1, 1, 1, 1, 1024, 1024, budget, &memory))
+//           ...                         // The model alone does not fit
+//         if (memory.model_bytes + memory.state_bytes > budget)
+//           ...                         // Too large, try smaller outputs
+//         struct wfc_model *model = wfc_model_overlapping_capped(
+//             input_image, 3, 3, 1, 1, 1, 1, 4, budget);
+//
+// Worlds too large for one output can be generated in chunks with
+// wfc_run_chunked. Chunks are generated row after row, each one fitting
+// the chunks above and on the left, and passed to a callback which can
+// store them away. Only the edges of the latest row of chunks are kept:
+//
+//         int store_chunk(void *user_data, int chunk_x, int chunk_y,
+//                         const struct wfc_image *image, const int *tiles)
+//         {
+//           ...
+//           return 1;  // 0 to stop
+//         }
+//
+//         wfc_run_chunked(model, 64, 64, 16, -1, seed, 8, store_chunk, NULL);
+//         // 16 chunks per row and no limit on rows, 8 seeds per chunk
+//
 //
 // Working with image files
 // ----------------------------------------
@@ -119,6 +302,8 @@
 #ifndef WFC_H
 #define WFC_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -132,6 +317,59 @@ struct wfc_image {
   int height;
 };
 
+// Results of wfc_run_for
+enum wfc_run_result {
+  WFC_RUN_FAILED,              // Contradiction occurred, needs wfc_init
+  WFC_RUN_DONE,                // All cells collapsed
+  WFC_RUN_STOPPED,             // Out of time or cancelled, the next run
+                               // goes on from there
+};
+
+// Counters and timings, filled in when wfc.h is compiled with
+// WFC_USE_STATS. Times are in nanoseconds.
+struct wfc_stats {
+  /* model, 0 for loaded models */
+  long long tiles_ns;          // Cutting tiles out of the input, duplicates
+                               // are merged as the tiles are cut
+  long long rules_ns;          // Computing which tiles can be neighbours
+  int tile_cnt;                // Unique tiles
+
+  /* runs since wfc_init, including its propagation */
+  long long collapse_cnt;
+  long long prop_cnt;          // Props propagated, bans with support propagation
+  long long prop_skip_cnt;     // Props not queued as the same one was pending
+  long long ban_cnt;           // Tiles removed from cells
+  long long contradiction_cnt; // Failed collapses, backtracked if enabled
+  long long next_cell_ns;      // Picking cells to collapse
+  long long propagate_ns;      // Collapsing, propagating and backtracking
+
+  /* memory in bytes, allocations don't grow except the trail */
+  size_t cell_bytes;           // Cells, their tiles, heap and template
+  size_t prop_bytes;           // Props, with support propagation also supports,
+                               // bans and their template
+  size_t rule_bytes;           // allowed_tiles or neighbours, initial supports
+                               // and frequencies
+  size_t backtrack_bytes;      // Decisions and trail
+};
+
+// Bytes wfc_model_overlapping and wfc_state_create allocate for the same
+// arguments, see wfc_estimate_memory
+struct wfc_memory {
+  int tile_cnt;
+  int neighbour_lists;         // 1 if the rules are kept as lists
+  size_t tile_bytes;           // Tiles and their pixels
+  size_t rule_bytes;           // allowed_tiles or neighbours, initial supports
+                               // and frequencies
+  size_t model_bytes;          // Whole model
+  size_t cell_bytes;           // Cells and their tiles
+  size_t prop_bytes;           // Props and their pending flags
+  size_t state_bytes;          // Whole state with scan propagation
+  size_t template_bytes;       // Template of the cells, added with support
+                               // propagation or constraints
+  size_t support_bytes;        // Supports, bans and their template, added
+                               // with support propagation
+};
+
 struct wfc *wfc_overlapping(int output_width,              // Output width in pixels
                             int output_height,             // Output height in pixels
                             struct wfc_image *image,       // Input image to be cut into tiles
@@ -143,10 +381,143 @@ struct wfc *wfc_overlapping(int output_width,              // Output width in pi
                             int rotate_tiles);             // Add n*90deg rotations of all tiles
 
 void wfc_init(struct wfc *wfc); // Resets wfc generation, wfc_run can be called again
+void wfc_init_seed(struct wfc *wfc, unsigned int seed); // Same as wfc_init but with a fixed seed
 int wfc_run(struct wfc *wfc, int max_collapse_cnt);
+int wfc_run_for(struct wfc *wfc, long long time_ns); // Return one of enum wfc_run_result
+void wfc_set_cancel(struct wfc *wfc, const volatile int *cancel); // Runs stop when *cancel becomes non-0, can be NULL
+void wfc_set_progress(struct wfc *wfc, void (*progress)(void *user_data, int collapsed_cell_cnt, int cell_cnt), void *user_data);
+struct wfc_image *wfc_output_image(struct wfc *wfc);
+const int *wfc_tiles(const struct wfc *wfc); // Tile index of each cell, -1 if not collapsed, owned by wfc
+int wfc_rasterize(const struct wfc *wfc, unsigned char *pixels, int stride); // Return 0 if not collapsed
+int wfc_stats(const struct wfc *wfc, struct wfc_stats *stats); // Return 0 without WFC_USE_STATS
+int wfc_regenerate_rect(struct wfc *wfc, int x, int y, int width, int height); // Solves the cells in the rectangle again
+int wfc_constrain(struct wfc *wfc, int n, const int *cells, const int *tiles); // Cell cells[i] may have tiles[i], kept by wfc_init
+void wfc_clear_constraints(struct wfc *wfc);
 int wfc_export(struct wfc *wfc, const char *filename);
 void wfc_destroy(struct wfc *wfc);
 
+// Model holds the rules, it is built once and shared read-only by states.
+// A state holds everything needed for a single run, states sharing
+// a model can run on separate threads.
+
+struct wfc_model;
+struct wfc_state;
+
+struct wfc_model *wfc_model_overlapping(struct wfc_image *image,   // Input image to be cut into tiles
+                                        int tile_width,            // Tile width in pixels
+                                        int tile_height,           // Tile height in pixels
+                                        int expand_input,          // Wrap input image on right and bottom
+                                        int xflip_tiles,           // Add xflips of all tiles
+                                        int yflip_tiles,           // Add yflips of all tiles
+                                        int rotate_tiles,          // Add n*90deg rotations of all tiles
+                                        int thread_cnt);           // Threads building the rules, requires WFC_USE_PTHREADS
+// Same as wfc_model_overlapping, failing rather than going over memory_cap
+// bytes for the model and any state created from it, 0 for no cap
+struct wfc_model *wfc_model_overlapping_capped(struct wfc_image *image,
+                                               int tile_width,
+                                               int tile_height,
+                                               int expand_input,
+                                               int xflip_tiles,
+                                               int yflip_tiles,
+                                               int rotate_tiles,
+                                               int thread_cnt,
+                                               size_t memory_cap);
+void wfc_model_destroy(struct wfc_model *model);
+
+// Cuts the tiles and counts the rules, without allocating them, to fill
+// memory. Return 0 on error, or if the model would not fit in memory_cap,
+// memory is still filled then.
+int wfc_estimate_memory(struct wfc_image *image,
+                        int tile_width,
+                        int tile_height,
+                        int expand_input,
+                        int xflip_tiles,
+                        int yflip_tiles,
+                        int rotate_tiles,
+                        int output_width,
+                        int output_height,
+                        size_t memory_cap,         // As in wfc_model_overlapping_capped
+                        struct wfc_memory *memory);
+
+// Rules cache. The key identifies the input image and the parameters of
+// wfc_model_overlapping, loading fails if the file holds another key.
+unsigned long long wfc_model_key(struct wfc_image *image,
+                                 int tile_width,
+                                 int tile_height,
+                                 int expand_input,
+                                 int xflip_tiles,
+                                 int yflip_tiles,
+                                 int rotate_tiles);
+int wfc_model_save(const struct wfc_model *model, unsigned long long key, const char *filename);
+struct wfc_model *wfc_model_load(const char *filename, unsigned long long key);
+
+// Coarse-to-fine generation for large outputs, NULL on error
+struct wfc_image *wfc_overlapping_hierarchical(struct wfc_image *image,   // Input image to be cut into tiles
+                                               int tile_width,            // Tile width in pixels
+                                               int tile_height,           // Tile height in pixels
+                                               int expand_input,          // Wrap input image on right and bottom
+                                               int xflip_tiles,           // Add xflips of all tiles
+                                               int yflip_tiles,           // Add yflips of all tiles
+                                               int rotate_tiles,          // Add n*90deg rotations of all tiles
+                                               int thread_cnt,            // Threads building the rules, requires WFC_USE_PTHREADS
+                                               int output_width,          // Output width in pixels
+                                               int output_height,         // Output height in pixels
+                                               int level_cnt,             // Levels, each half the size of the next
+                                               unsigned int seed,         // Window j of level i uses seeds from seed+(i+j*level_cnt)*attempt_cnt
+                                               int attempt_cnt);          // Seeds tried per window
+
+struct wfc_state *wfc_state_create(const struct wfc_model *model, int output_width, int output_height);
+void wfc_state_init(struct wfc_state *state, unsigned int seed); // Resets generation
+int wfc_state_run(struct wfc_state *state, int max_collapse_cnt);
+int wfc_state_run_for(struct wfc_state *state, long long time_ns);
+void wfc_state_set_cancel(struct wfc_state *state, const volatile int *cancel);
+void wfc_state_set_progress(struct wfc_state *state, void (*progress)(void *user_data, int collapsed_cell_cnt, int cell_cnt), void *user_data);
+struct wfc_image *wfc_state_output_image(struct wfc_state *state);
+const int *wfc_state_tiles(const struct wfc_state *state);
+int wfc_state_rasterize(const struct wfc_state *state, unsigned char *pixels, int stride);
+int wfc_state_stats(const struct wfc_state *state, struct wfc_stats *stats);
+int wfc_state_regenerate_rect(struct wfc_state *state, int x, int y, int width, int height);
+int wfc_state_constrain(struct wfc_state *state, int n, const int *cells, const int *tiles); // Call after wfc_state_init
+void wfc_state_clear_constraints(struct wfc_state *state);
+int wfc_state_export(struct wfc_state *state, const char *filename);
+void wfc_state_destroy(struct wfc_state *state);
+
+int wfc_run_batch(const struct wfc_model *model,
+                  int output_width,
+                  int output_height,
+                  int n,                           // Number of outputs to generate
+                  const unsigned int *seeds,       // One per output, can be NULL
+                  int thread_cnt,                  // Requires WFC_USE_PTHREADS
+                  struct wfc_image **outputs);     // n outputs, NULL on contradiction
+
+struct wfc_image *wfc_run_race(const struct wfc_model *model,
+                               int output_width,
+                               int output_height,
+                               unsigned int seed,          // Attempt i uses seed+i
+                               int attempt_cnt,            // Max number of attempts
+                               int thread_cnt,             // Requires WFC_USE_PTHREADS
+                               unsigned int *winning_seed);// Seed of the returned output, can be NULL
+
+int wfc_run_chunked(const struct wfc_model *model,
+                    int chunk_width,               // Chunk width in pixels
+                    int chunk_height,              // Chunk height in pixels
+                    int chunk_cnt_x,               // Chunks per row
+                    int chunk_cnt_y,               // Rows of chunks, -1 for no limit
+                    unsigned int seed,
+                    int attempt_cnt,               // Seeds tried per chunk
+                    int (*callback)(void *user_data, int chunk_x, int chunk_y,
+                                    const struct wfc_image *image, // Chunk pixels
+                                    const int *tiles),             // Chunk tile indices
+                                    // Return 0 to stop
+                    void *user_data);
+
+struct wfc_image *wfc_run_parallel(const struct wfc_model *model,
+                                   int output_width,
+                                   int output_height,
+                                   unsigned int seed,      // Stripe i uses seeds from seed+i*attempt_cnt
+                                   int attempt_cnt,        // Seeds tried per stripe
+                                   int thread_cnt);        // Requires WFC_USE_PTHREADS
+
 #ifdef __cplusplus
 }
 #endif
@@ -168,50 +539,92 @@ void wfc_destroy(struct wfc *wfc);
 #include <math.h>
 #include <float.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <time.h>
 #include <assert.h>
 
-#define WFC_MAX_PROP_CNT 1000
+#ifdef WFC_USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#if !defined(WFC_NO_SIMD) && defined(__AVX2__)
+#define WFC__AVX2
+#include <immintrin.h>
+#elif !defined(WFC_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define WFC__SSE2
+#include <emmintrin.h>
+#elif !defined(WFC_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define WFC__NEON
+#include <arm_neon.h>
+#endif
 
 #ifndef WFC_USE_STB
 
 #define wfc_img_save(...) wfc__nofunc_int("wfc_img_save", "requires stb", __VA_ARGS__)
 #define wfc_img_load(...) wfc__nofunc_ptr("wfc_img_load", "requires stb", __VA_ARGS__)
 #define wfc_export(...)   wfc__nofunc_int("wfc_export", "requires_stb", __VA_ARGS__)
+#define wfc_state_export(...) wfc__nofunc_int("wfc_state_export", "requires_stb", __VA_ARGS__)
 #define wfc_export_tiles(...) wfc__nofunc_int("wfc_export_tiles", "requires_stb", __VA_ARGS__)
 
 #endif
 
 #if defined(WFC_DEBUG) || defined(WFC_TOOL)
 
-#define print_progress(int_progress) \
-  do { \
-    printf("\rcells collapsed:      %d", int_progress); \
-    fflush(stdout); \
-  } while(0)
-
-#define print_endprogress() printf("\n")
 #define wfcassert(test) assert(test)
 #define p(...) printf(__VA_ARGS__)
 
 #else
 
-#define print_progress(int_progress)
-#define print_endprogress()
 #define wfcassert(test)
-#define p(...)
+#define p(...) ((void)0)
+
+#endif
+
+// Statements counting or timing for wfc_stats, dropped without
+// WFC_USE_STATS
+#ifdef WFC_USE_STATS
+#define WFC__STAT(...) __VA_ARGS__
+#else
+#define WFC__STAT(...)
+#endif
 
+#define WFC__WORD_BITS 64
+
+// Inlined where a constant word count specializes the code for small tile
+// sets, see wfc__propagate_prop
+#if defined(__GNUC__) || defined(__clang__)
+#define WFC__INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define WFC__INLINE __forceinline
+#else
+#define WFC__INLINE inline
 #endif
 
 enum wfc__direction {WFC_UP,WFC_DOWN,WFC_LEFT,WFC_RIGHT};
 int directions[4] = {WFC_UP, WFC_DOWN, WFC_LEFT, WFC_RIGHT};
 enum wfc__method {WFC_METHOD_OVERLAPPING, WFC_METHOD_TILED};
 
+// How cell updates are propagated to neighbouring cells
+//
+// WFC_PROPAGATION_SCAN     Recompute the tiles a cell allows from all of
+//                          its remaining tiles, every time it changes.
+// WFC_PROPAGATION_SUPPORT  Keep per-cell counters of supporting tiles in
+//                          each direction (AC-4). Removing a tile only
+//                          decrements its neighbours' counters, and a tile
+//                          is removed once one of its counters hits zero.
+enum wfc__propagation {WFC_PROPAGATION_SCAN, WFC_PROPAGATION_SUPPORT};
+
+// How the next cell to collapse is found
+//
+// WFC_SELECTION_HEAP  Keep uncollapsed cells in a min-heap ordered by
+//                     entropy. Cells changed by propagation are re-sorted
+//                     before the next pick.
+// WFC_SELECTION_SCAN  Scan all cells for the smallest entropy.
+enum wfc__selection {WFC_SELECTION_HEAP, WFC_SELECTION_SCAN};
+
 // Rules are stored in tiles
 struct wfc__tile {
-  struct wfc_image *image;
-
   int freq;                    // Relative frequency of the tile. Typically a
                                // count of tile occurrences in the input image.
                                // It affects the probability of the tile being
@@ -219,15 +632,27 @@ struct wfc__tile {
 };
 
 struct wfc__cell {
-  int *tiles;                  // Possible tiles in the cell (initially all)
-  int tile_cnt;
+  uint64_t *tiles;             // Bitset of possible tiles in the cell
+  int tile_cnt;                // (initially all), tile_word_cnt words
 
   int sum_freqs;               // Sum of tile frequencies used to calculate
                                // entropy and randomly pick a tile when
                                // collapsing a tile.
+  double sum_freq_log_freqs;   // Sum of freq*log(freq) of the tiles
 
   double entropy;              // Shannon entropy. Cell with the smallest entropy
-                               // is picked to be collapsed next.
+                               // is picked to be collapsed next. Updated from
+                               // the sums once per change, see wfc__next_cell.
+
+  double noise;                // Small noise added to entropy to break ties
+                               // between cells with the same entropy. Drawn
+                               // once per cell in wfc_init.
+};
+
+// PCG32 random number generator, one per wfc
+struct wfc__rng {
+  uint64_t state;
+  uint64_t inc;
 };
 
 struct wfc__prop {
@@ -236,23 +661,85 @@ struct wfc__prop {
   enum wfc__direction direction;
 };
 
-// One structure for overlapping and tiled models
-struct wfc {
+// Tile removed from a cell, pending propagation to the cell's neighbours
+struct wfc__ban {
+  int cell_idx;
+  int tile_idx;
+};
+
+// Tile removed from a cell, restored when backtracking
+struct wfc__change {
+  int cell_idx;
+  int tile_idx;
+};
+
+// Collapse that can be undone by backtracking
+struct wfc__decision {
+  int cell_idx;
+  int tile_idx;                // Tile picked by the collapse
+  int trail_cnt;               // Trail length before the collapse
+};
+
+// Rules shared read-only by any number of states. One structure for
+// overlapping and tiled models.
+struct wfc_model {
   enum wfc__method method;     // overlapping or tiled?
-  unsigned int seed;
 
   /* tiles */
 
-  struct wfc_image *image;     // Input image, not always required
   int tile_width;              // Tile width in pixels
   int tile_height;             // Tile height in pixels
+  int component_cnt;           // Components per pixel of tile images
   int expand_input;
   int xflip_tiles;
   int yflip_tiles;
   int rotate_tiles;
   struct wfc__tile *tiles;     // All available tiles
+  unsigned char *tile_pixels;  // Pixels of all tiles, tile after tile, see
+                               // wfc__tile_image
   int tile_cnt;
   int sum_freqs;
+  double *freq_log_freqs;      // freq*log(freq) of each tile
+  double sum_freq_log_freqs;
+  double entropy;              // Entropy of a cell with all tiles
+
+  // These are the rules. One row bitset per (direction, src tile).
+  // Bit dst_idx of the row allowed_tiles[d] + src_idx*tile_word_cnt is
+  // set if dst_idx tile can be placed next to the src_idx tile in the
+  // direction d.
+  //
+  // In the overlapping method tiles are allowed next to each other if
+  // their content overlaps, excluding the edges.
+  uint64_t *allowed_tiles[4];
+  int tile_word_cnt;           // Number of 64-bit words in one row
+
+  // Same rules as lists, for sparse rules of many tiles. The tiles allowed
+  // next to src_idx in the direction d are neighbours[neighbour_offsets[r]]
+  // up to neighbours[neighbour_offsets[r+1]-1], in increasing order, with
+  // r = d*tile_cnt + src_idx. Only one of allowed_tiles and neighbours is
+  // built, the other is NULL, see wfc__use_neighbour_lists.
+  int *neighbours;
+  int *neighbour_offsets;      // 4*tile_cnt + 1 offsets
+
+  // initial_supports[tile_idx*4 + d] is the number of tiles that allow
+  // tile_idx in the direction d
+  int *initial_supports;
+
+  size_t memory_cap;           // Bytes for the model and any one of its
+                               // states, 0 for no cap. Takes effect in
+                               // wfc_state_create and wfc_state_init.
+
+#ifdef WFC_USE_STATS
+  struct wfc_stats stats;      // Model fields only
+#endif
+};
+
+// Per-run solver state. States don't modify their model, so states
+// sharing a model can run on separate threads.
+struct wfc_state {
+  const struct wfc_model *model;
+  unsigned int seed;
+  struct wfc__rng rng;
 
   /* output */
 
@@ -260,24 +747,97 @@ struct wfc {
   int output_height;           // Output height in pixels
   struct wfc__cell *cells;     // One per output pixel
   int cell_cnt;                // width * height
+  int *cell_tiles;             // Tile of each collapsed cell, -1 if it has
+                               // more tiles or none, see wfc_state_tiles
 
   /* in-use */
 
-  struct wfc__prop *props;     // Propagation updates
-  int prop_cnt;
-  int prop_idx;                // Current index into props, used to scan
-                               // props forward to check whether a
-                               // a candidate prop is already there
+  // Pending propagation updates, a ring buffer. At most one prop per
+  // (cell, direction) is pending at a time, hence 4*cell_cnt props fit.
+  struct wfc__prop *props;
+  int prop_cnt;                // Number of pending props
+  int prop_head;               // Index of the next prop to propagate
+  unsigned char *prop_pending; // prop_pending[cell_idx*4 + d] is 1 if a prop
+                               // from the cell in direction d is pending
   int collapsed_cell_cnt;
 
-  // These are the rules. A matrix lookup of allowed tile pairs in each
-  // direction. allowed_tiles[d][src_idx*tile_cnt + dst_idx] is 1 or 0
-  // depending on whether dst_idx tile can be placed next to the src_idx
-  // tile in the direction d.
-  //
-  // In the overlapping method tiles are allowed next to each other if
-  // their content overlaps, excluding the edges.
-  int *allowed_tiles[4];
+  /* next cell selection */
+
+  enum wfc__selection selection; // Takes effect in wfc_state_init
+  int *heap;                   // Uncollapsed cells, min-heap by entropy+noise
+  int heap_cnt;
+  int *heap_pos;               // Position of each cell in the heap, -1 if none
+  int *dirty;                  // Cells whose tiles changed since the last pick,
+  int dirty_cnt;               // entropy updated and re-sorted lazily in
+                               // wfc__next_cell
+  unsigned char *cell_dirty;   // 1 if the cell is in dirty
+
+  uint64_t *support;           // Scratch rows: union of the allowed rows of
+                               // all tiles in a source cell, followed by the
+                               // tiles it removes from the destination cell
+
+  /* support propagation */
+
+  enum wfc__propagation propagation; // Takes effect in wfc_state_init
+
+  // supports[(cell_idx*tile_cnt + tile_idx)*4 + d] is the number of tiles
+  // in the neighbouring cell that allow tile_idx in the cell, where d is
+  // the direction from the neighbour to the cell.
+  int *supports;
+  struct wfc__ban *bans;       // Stack of removed tiles, each tile is
+  int ban_cnt;                 // removed from a cell at most once
+
+  const volatile int *cancel;  // wfc_state_run stops when *cancel becomes
+                               // non-0 (set from another thread), can be NULL
+  int started;                 // 1 once a run collapsed its first cell, later
+                               // runs go on from wfc__next_cell
+  int start_cell_idx;          // Random first cell, kept for runs stopped
+                               // before collapsing it, -1 until picked
+
+  // Called before each collapse and at the end of runs, can be NULL
+  void (*progress)(void *user_data, int collapsed_cell_cnt, int cell_cnt);
+  void *progress_user_data;
+
+  /* backtracking */
+
+  int max_backtrack_cnt;       // Backtracks allowed after wfc_state_init
+                               // before giving up, 0 disables backtracking.
+                               // Takes effect in wfc_state_init.
+  int backtrack_depth;         // Number of latest decisions that can be
+                               // undone, 0 means all. Older decisions are
+                               // kept for good and their changes forgotten.
+                               // Takes effect in wfc_state_init.
+  int backtrack_cnt;           // Backtracks done since wfc_state_init
+  struct wfc__decision *decisions; // Decisions that can be undone, by age
+  int decision_cnt;
+  int decision_cap;
+  struct wfc__change *trail;   // Tiles removed since the oldest decision
+  int trail_cnt;
+  int trail_cap;
+
+  /* initial state */
+
+  // Cells and supports as left by the first wfc_state_init with support
+  // propagation, after the tiles not allowed next to the output's borders
+  // were removed, and by wfc_state_constrain. Later inits copy them instead
+  // of recomputing. Scan propagation without constraints starts from all
+  // tiles and fills cells directly.
+  struct wfc__cell *template_cells; // NULL if not built
+  int *template_supports;      // NULL with scan propagation
+  int template_collapsed_cell_cnt;
+  int constrained;             // 1 after wfc_state_constrain, the template
+                               // then holds the constraints
+
+#ifdef WFC_USE_STATS
+  struct wfc_stats stats;      // Run fields only, reset by wfc_state_init
+#endif
+};
+
+// Model and a single state, as created by wfc_overlapping
+struct wfc {
+  struct wfc_image *image;     // Input image, not always required
+  struct wfc_model *model;
+  struct wfc_state *state;
 };
 
 #ifdef WFC_DEBUG
@@ -425,6 +985,30 @@ static struct wfc_image *wfc__img_expand(struct wfc_image *image, int xexp, int
   return exp_image;
 }
 
+// Keeps every factor-th pixel in both directions, so that the pixels of
+// the smaller image are pixels of the image
+//
+// Return NULL on error
+static struct wfc_image *wfc__img_downsample(struct wfc_image *image, int factor)
+{
+  int component_cnt = image->component_cnt;
+  struct wfc_image *small_image = wfc_img_create(image->width / factor, image->height / factor, component_cnt);
+  if (small_image == NULL) {
+    p("wfc__img_downsample: error\n");
+    return NULL;
+  }
+
+  for (int y=0; y<small_image->height; y++) {
+    for (int x=0; x<small_image->width; x++) {
+      memcpy(&small_image->data[(y * small_image->width + x) * component_cnt],
+             &image->data[(y * factor * image->width + x * factor) * component_cnt],
+             component_cnt);
+    }
+  }
+
+  return small_image;
+}
+
 // Return 1 if the two images overlap perfectly except the edges in the given direction, 0 otherwise.
 static int wfc__img_cmpoverlap(struct wfc_image *a, struct wfc_image *b, enum wfc__direction direction)
 {
@@ -473,80 +1057,49 @@ static int wfc__img_cmpoverlap(struct wfc_image *a, struct wfc_image *b, enum wf
   return 1;
 }
 
-// Return NULL on error
-static struct wfc_image *wfc__img_flip_horizontally(struct wfc_image *image)
+// Writes the image flipped horizontally to dst of the same size
+static void wfc__img_flip_horizontally(struct wfc_image *dst, struct wfc_image *image)
 {
-  struct wfc_image *copy = wfc_img_copy(image);
-  if (copy == NULL) {
-    p("wfc__img_flip_horizontally: error\n");
-    return NULL;
-  }
-
   for (int y=0; y<image->height; y++) {
-    for (int x=0; x<image->width/2; x++) {
-      unsigned char *src = &( image->data[y*image->width*image->component_cnt + x*image->component_cnt] );
-      unsigned char *dst = &( copy->data[y*image->width*image->component_cnt + (image->width-1-x)*image->component_cnt] );
-      memcpy(dst, src, image->component_cnt);
-
-      src = &( image->data[y*image->width*image->component_cnt + (image->width-1-x)*image->component_cnt] );
-      dst = &( copy->data[y*image->width*image->component_cnt + x*image->component_cnt] );
-      memcpy(dst, src, image->component_cnt);
+    for (int x=0; x<image->width; x++) {
+      memcpy(&( dst->data[y*image->width*image->component_cnt + (image->width-1-x)*image->component_cnt] ),
+             &( image->data[y*image->width*image->component_cnt + x*image->component_cnt] ),
+             image->component_cnt);
     }
   }
-  return copy;
 }
 
-// Return NULL on error
-static struct wfc_image *wfc__img_flip_vertically(struct wfc_image *image)
+// Writes the image flipped vertically to dst of the same size
+static void wfc__img_flip_vertically(struct wfc_image *dst, struct wfc_image *image)
 {
-  struct wfc_image *copy = wfc_img_copy(image);
-  if (copy == NULL) {
-    p("wfc__img_flip_vertically: error\n");
-    return NULL;
-  }
-
-  for (int y=0; y<image->height/2; y++) {
-    unsigned char *src = &( image->data[y*image->width*image->component_cnt] );
-    unsigned char *dst = &( copy->data[(image->height-1-y)*image->width*image->component_cnt] );
-    memcpy(dst, src, image->width*image->component_cnt);
-
-    src = &( image->data[(image->height-1-y)*image->width*image->component_cnt] );
-    dst = &( copy->data[y*image->width*image->component_cnt] );
-    memcpy(dst, src, image->width*image->component_cnt);
+  for (int y=0; y<image->height; y++) {
+    memcpy(&( dst->data[(image->height-1-y)*image->width*image->component_cnt] ),
+           &( image->data[y*image->width*image->component_cnt] ),
+           image->width*image->component_cnt);
   }
-  return copy;
 }
 
-static struct wfc_image *wfc__img_rotate90(struct wfc_image *image, int n) {
+// Writes the image rotated by n*90deg to dst, which is image->height wide
+// and image->width high for odd n
+static void wfc__img_rotate90(struct wfc_image *dst, struct wfc_image *image, int n) {
   wfcassert(n>0);
 
   n %= 4;
 
-  struct wfc_image *copy;
-  if (n%2) {
-    copy = wfc_img_create(image->height, image->width, image->component_cnt);
-  } else {
-    copy = wfc_img_create(image->width, image->height, image->component_cnt);
-  }
-  if (copy == NULL) {
-    p("wfc__img_rotate90: error\n");
-    return NULL;
-  }
-
   for (int y=0; y<image->height; y++) {
     for (int x=0; x<image->width; x++) {
       unsigned char components[4];
       memcpy(components, &(image->data[y * image->width * image->component_cnt + x * image->component_cnt]), image->component_cnt);
       if (n==1) {
-        memcpy(&(copy->data[x * copy->width * copy->component_cnt + (copy->width - y - 1) * copy->component_cnt]),
+        memcpy(&(dst->data[x * dst->width * dst->component_cnt + (dst->width - y - 1) * dst->component_cnt]),
                components,
                image->component_cnt);
       } else if (n==2) {
-        memcpy(&(copy->data[(copy->height - y - 1) * copy->width * copy->component_cnt + (copy->width - x - 1) * copy->component_cnt]),
+        memcpy(&(dst->data[(dst->height - y - 1) * dst->width * dst->component_cnt + (dst->width - x - 1) * dst->component_cnt]),
                components,
                image->component_cnt);
       } else if (n==3) {
-        memcpy(&(copy->data[(copy->height - x - 1) * copy->width * copy->component_cnt + y * copy->component_cnt]),
+        memcpy(&(dst->data[(dst->height - x - 1) * dst->width * dst->component_cnt + y * dst->component_cnt]),
                components,
                image->component_cnt);
       } else {
@@ -555,16 +1108,6 @@ static struct wfc_image *wfc__img_rotate90(struct wfc_image *image, int n) {
       }
     }
   }
-  return copy;
-}
-
-// Return 1 if the two images are the same, 0 otherwise.
-static int wfc__img_cmp(struct wfc_image *a, struct wfc_image *b)
-{
-  if (a->width!=b->width || a->height!=b->height || a->component_cnt!=b->component_cnt) {
-    return 0;
-  }
-  return memcmp(a->data, b->data, a->width*a->height*a->component_cnt) == 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -585,219 +1128,808 @@ static void *wfc__nofunc_ptr(const char *func_name, const char *msg, ...)
   return NULL;
 }
 
-static void wfc_destroy_cells(int *cells)
+static int wfc__word_cnt(int bit_cnt)
 {
-  free(cells);
+  return (bit_cnt + WFC__WORD_BITS - 1) / WFC__WORD_BITS;
 }
 
-// Return NULL on error
-static int *wfc_cells(struct wfc *wfc)
+static int wfc__bit_test(const uint64_t *row, int idx)
 {
-  int *cells = malloc(sizeof(*cells) * wfc->cell_cnt);
-  if (cells == NULL)
-    return NULL;
+  return (row[idx / WFC__WORD_BITS] >> (idx % WFC__WORD_BITS)) & 1;
+}
 
-  for (int i=0; i<wfc->cell_cnt; i++)
-    cells[i] = wfc->cells[i].tiles[0];
+static void wfc__bit_set(uint64_t *row, int idx)
+{
+  row[idx / WFC__WORD_BITS] |= (uint64_t)1 << (idx % WFC__WORD_BITS);
+}
 
-  return cells;
+static void wfc__bit_clear(uint64_t *row, int idx)
+{
+  row[idx / WFC__WORD_BITS] &= ~((uint64_t)1 << (idx % WFC__WORD_BITS));
 }
 
-struct wfc_image *wfc_output_image(struct wfc *wfc)
+// Index of the lowest set bit, word must not be 0
+static int wfc__ctz(uint64_t word)
 {
-  struct wfc_image *image = wfc_img_create(wfc->output_width, wfc->output_height, wfc->image->component_cnt);
-  if (image == NULL) {
-    p("wfc_export: error\n");
-    return 0;
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(word);
+#else
+  int n = 0;
+  while (!(word & 1)) {
+    word >>= 1;
+    n++;
   }
+  return n;
+#endif
+}
 
-  for (int y=0; y<wfc->output_height; y++) {
-    for (int x=0; x<wfc->output_width; x++) {
-      struct wfc__cell *cell = &( wfc->cells[y * wfc->output_width + x] );
-
-      double components[4] = {0, 0, 0, 0};
-      for (int i=0; i<cell->tile_cnt; i++) {
-        struct wfc__tile *tile = &( wfc->tiles[ cell->tiles[i] ] );
-        for (int j=0; j<wfc->image->component_cnt; j++) {
-          components[j] += tile->image->data[j];
-        }
-      }
+static int wfc__popcount(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(word);
+#else
+  int n = 0;
+  for (; word; word &= word-1)
+    n++;
+  return n;
+#endif
+}
 
-      for (int i=0; i<wfc->image->component_cnt; i++) {
-        image->data[y * wfc->output_width * wfc->image->component_cnt + x * wfc->image->component_cnt + i] = (unsigned char)(components[i] / cell->tile_cnt);
-      }
-    }
+// Return index of the lowest set bit, -1 if there is none
+static int wfc__first_bit(const uint64_t *row, int word_cnt)
+{
+  for (int w=0; w<word_cnt; w++) {
+    if (row[w])
+      return w * WFC__WORD_BITS + wfc__ctz(row[w]);
   }
-
-  return image;
+  return -1;
 }
 
-#ifdef WFC_USE_STB
+// Row kernels working on whole bitsets. They use AVX2, SSE2 or NEON when
+// the compiler targets them, unless WFC_NO_SIMD is defined.
 
-// Return 0 on error, non-0 on success
-// dep: stb
-int wfc_export(struct wfc *wfc, const char *filename)
+// dst |= src
+static WFC__INLINE void wfc__row_or(uint64_t *dst, const uint64_t *src, int word_cnt)
 {
-  struct wfc_image *image = wfc_output_image(wfc);
-  int rv = wfc_img_save(image, filename);
-  wfc_img_destroy(image);
-
-  return rv;
+  int w = 0;
+#if defined(WFC__AVX2)
+  for (; w+4<=word_cnt; w+=4) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + w));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + w));
+    _mm256_storeu_si256((__m256i *)(dst + w), _mm256_or_si256(d, s));
+  }
+#elif defined(WFC__SSE2)
+  for (; w+2<=word_cnt; w+=2) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + w));
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + w));
+    _mm_storeu_si128((__m128i *)(dst + w), _mm_or_si128(d, s));
+  }
+#elif defined(WFC__NEON)
+  for (; w+2<=word_cnt; w+=2)
+    vst1q_u64(dst + w, vorrq_u64(vld1q_u64(dst + w), vld1q_u64(src + w)));
+#endif
+  for (; w<word_cnt; w++)
+    dst[w] |= src[w];
 }
 
-// Return 0 on error, non-0 on success
-// dep: stb
-int wfc_export_tiles(struct wfc *wfc, const char *path)
+// Return 1 if all bits of a are set in b
+static WFC__INLINE int wfc__row_subset(const uint64_t *a, const uint64_t *b, int word_cnt)
 {
-  char filename[128];
-  for (int i=0; i<wfc->tile_cnt; i++) {
-    sprintf(filename, "%s/%d.png", path, i);
-    struct wfc__tile *tile = &wfc->tiles[i];
-    if (wfc_img_save(tile->image, filename) == 0) {
-      p("wfc_export_tiles: error\n");
+  int w = 0;
+#if defined(WFC__AVX2)
+  for (; w+4<=word_cnt; w+=4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + w));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + w));
+    if (!_mm256_testc_si256(y, x))
+      return 0;
+  }
+#elif defined(WFC__SSE2)
+  for (; w+2<=word_cnt; w+=2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + w));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + w));
+    __m128i outside = _mm_andnot_si128(y, x);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(outside, _mm_setzero_si128())) != 0xFFFF)
+      return 0;
+  }
+#elif defined(WFC__NEON)
+  for (; w+2<=word_cnt; w+=2) {
+    uint64x2_t outside = vbicq_u64(vld1q_u64(a + w), vld1q_u64(b + w));
+    if (vgetq_lane_u64(outside, 0) | vgetq_lane_u64(outside, 1))
+      return 0;
+  }
+#endif
+  for (; w<word_cnt; w++) {
+    if (a[w] & ~b[w])
       return 0;
-    }
   }
   return 1;
 }
 
-#endif // WFC_USE_STB
-
-// Return NULL on error
-// Assumes the tile fits in the image
-static struct wfc_image *wfc__create_tile_image(struct wfc_image *image, int x, int y, int tile_width, int tile_height)
+// removed = dst & ~src, dst &= src
+static WFC__INLINE void wfc__row_and(uint64_t *dst, const uint64_t *src, uint64_t *removed, int word_cnt)
 {
-  struct wfc_image *tile_image = wfc_img_create(tile_width, tile_height, image->component_cnt);
-  if (tile_image == NULL) {
-    p("wfc__create_tile_image: error\n");
-    return NULL;
+  int w = 0;
+#if defined(WFC__AVX2)
+  for (; w+4<=word_cnt; w+=4) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + w));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + w));
+    _mm256_storeu_si256((__m256i *)(removed + w), _mm256_andnot_si256(s, d));
+    _mm256_storeu_si256((__m256i *)(dst + w), _mm256_and_si256(d, s));
   }
-
-  tile_image->width = tile_width;
-  tile_image->height = tile_height;
-  tile_image->component_cnt = image->component_cnt;
-
-  for (int i=0; i<tile_height; i++) {
-    memcpy(&tile_image->data[i * tile_width * image->component_cnt],
-           &image->data[(y+i) * image->width * image->component_cnt + x * image->component_cnt],
-           tile_width * image->component_cnt);
+#elif defined(WFC__SSE2)
+  for (; w+2<=word_cnt; w+=2) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + w));
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + w));
+    _mm_storeu_si128((__m128i *)(removed + w), _mm_andnot_si128(s, d));
+    _mm_storeu_si128((__m128i *)(dst + w), _mm_and_si128(d, s));
+  }
+#elif defined(WFC__NEON)
+  for (; w+2<=word_cnt; w+=2) {
+    uint64x2_t d = vld1q_u64(dst + w);
+    uint64x2_t s = vld1q_u64(src + w);
+    vst1q_u64(removed + w, vbicq_u64(d, s));
+    vst1q_u64(dst + w, vandq_u64(d, s));
+  }
+#endif
+  for (; w<word_cnt; w++) {
+    removed[w] = dst[w] & ~src[w];
+    dst[w] &= src[w];
   }
+}
 
-  return tile_image;
+// Return the number of set bits
+static WFC__INLINE int wfc__row_popcount(const uint64_t *row, int word_cnt)
+{
+  int w = 0;
+  int cnt = 0;
+#if defined(WFC__AVX2)
+  // Per nibble lookup, summed per 64-bit lane by _mm256_sad_epu8
+  const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                          0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i sums = _mm256_setzero_si256();
+  for (; w+4<=word_cnt; w+=4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(row + w));
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+    __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, sums);
+  cnt = (int)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+#elif defined(WFC__NEON)
+  uint64x2_t sums = vdupq_n_u64(0);
+  for (; w+2<=word_cnt; w+=2) {
+    uint8x16_t bytes = vcntq_u8(vreinterpretq_u8_u64(vld1q_u64(row + w)));
+    sums = vaddq_u64(sums, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(bytes))));
+  }
+  cnt = (int)(vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1));
+#endif
+  for (; w<word_cnt; w++)
+    cnt += wfc__popcount(row[w]);
+  return cnt;
 }
 
-// Return 0 on error
-static int wfc__add_overlapping_images(struct wfc__tile *tiles, struct wfc_image *image, int xcnt, int ycnt, int tile_width, int tile_height)
+// Flags shared between threads, e.g., to cancel runs
+static int wfc__load_flag(const volatile int *flag)
 {
-  int tile_cnt = xcnt * ycnt;
-  for (int y=0; y<ycnt; y++)
-    for (int x=0; x<xcnt; x++) {
-      struct wfc__tile *tile = &( tiles[y*xcnt + x] );
-      tile->freq = 1;
-      tile->image = wfc__create_tile_image(image, x, y, tile_width, tile_height);
-      if (tile->image == NULL)
-        goto CLEANUP;
-    }
+#if defined(__GNUC__) || defined(__clang__)
+  return __atomic_load_n(flag, __ATOMIC_RELAXED);
+#else
+  return *flag;
+#endif
+}
 
-  return 1;
+static void wfc__store_flag(volatile int *flag, int value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  __atomic_store_n(flag, value, __ATOMIC_RELAXED);
+#else
+  *flag = value;
+#endif
+}
 
- CLEANUP:
-  for (int i=0; i<tile_cnt; i++)
-    wfc_img_destroy(tiles[i].image);
+// Monotonic time in nanoseconds, CPU time where CLOCK_MONOTONIC is missing
+static long long wfc__now_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+  return (long long)((double)clock() / CLOCKS_PER_SEC * 1e9);
+#endif
+}
 
-  return 0;
+static uint32_t wfc__rng_next(struct wfc__rng *rng)
+{
+  uint64_t old = rng->state;
+  rng->state = old * 6364136223846793005ULL + rng->inc;
+  uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+  uint32_t rot = (uint32_t)(old >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
-// Return 0 on error, non-0 on success
-// flip_direction: 0 - horizontal, 1 vertical
-static int wfc__add_flipped_images(struct wfc__tile *tiles, int tile_idx, int flip_direction)
+static void wfc__rng_seed(struct wfc__rng *rng, uint64_t seed)
 {
-  for (int i=0; i<tile_idx; i++) {
-    struct wfc__tile *src = &tiles[i];
-    struct wfc__tile *dst = &tiles[tile_idx + i];
-    dst->freq = 1;
-    if (flip_direction == 0)
-      dst->image = wfc__img_flip_horizontally(src->image);
-    else
-      dst->image = wfc__img_flip_vertically(src->image);
+  rng->state = 0;
+  rng->inc = (seed << 1) | 1;
+  wfc__rng_next(rng);
+  rng->state += seed;
+  wfc__rng_next(rng);
+}
 
-    if (dst->image == NULL)
-      goto CLEANUP;
+// Return a number in [0, bound), bound must be > 0
+static uint32_t wfc__rng_below(struct wfc__rng *rng, uint32_t bound)
+{
+  // Reject the low values that would make the modulo biased
+  uint32_t threshold = -bound % bound;
+  while (1) {
+    uint32_t r = wfc__rng_next(rng);
+    if (r >= threshold)
+      return r % bound;
   }
+}
 
-  return 1;
+// Return a number in [0, 1)
+static double wfc__rng_double(struct wfc__rng *rng)
+{
+  return wfc__rng_next(rng) * (1.0 / 4294967296.0);
+}
 
- CLEANUP:
-  p("wfc__add_flipped_tiles: error\n");
-  for (int i=0; i<tile_idx; i++)
-    wfc_img_destroy(tiles[tile_idx + i].image);
+// View of the tile in tile-major pixels of tiles of the same size, valid
+// until the pixels are reallocated
+static struct wfc_image wfc__tile_image(unsigned char *pixels, int tile_idx, int tile_width, int tile_height, int component_cnt)
+{
+  struct wfc_image image;
+  image.data = pixels + (size_t)tile_idx * tile_width * tile_height * component_cnt;
+  image.component_cnt = component_cnt;
+  image.width = tile_width;
+  image.height = tile_height;
+  return image;
+}
 
-  return 0;
+// Tile index of each cell, row after row, -1 if the cell isn't collapsed.
+// The array belongs to the state and stays up to date as it runs.
+const int *wfc_state_tiles(const struct wfc_state *state)
+{
+  return state->cell_tiles;
 }
 
-// Return 0 on error, non-0 on success
-static int wfc__add_rotated_images(struct wfc__tile *tiles, int tile_idx)
+const int *wfc_tiles(const struct wfc *wfc)
 {
-  for (int i=0; i<tile_idx; i++) {
-    for (int j=0; j<3; j++) {
-      struct wfc__tile *src = &tiles[i];
-      struct wfc__tile *dst = &tiles[tile_idx + i*3 + j];
-      dst->freq = 1;
-      dst->image = wfc__img_rotate90(src->image, j+1);
+  return wfc_state_tiles(wfc->state);
+}
 
-      if (dst->image == NULL)
-        goto CLEANUP;
-    }
+// Writes the pixel of each cell's tile to pixels, output_width *
+// component_cnt bytes per row, stride bytes apart (0 for packed rows)
+//
+// Return 0, leaving pixels untouched, if a cell isn't collapsed
+int wfc_state_rasterize(const struct wfc_state *state, unsigned char *pixels, int stride)
+{
+  const struct wfc_model *model = state->model;
+  int component_cnt = model->component_cnt;
+  size_t tile_size = (size_t)model->tile_width * model->tile_height * component_cnt;
+  size_t row_size = stride > 0 ? (size_t)stride : (size_t)state->output_width * component_cnt;
+
+  for (int i=0; i<state->cell_cnt; i++) {
+    if (state->cell_tiles[i] == -1)
+      return 0;
   }
 
-  return 1;
+  for (int y=0; y<state->output_height; y++) {
+    unsigned char *row = pixels + y * row_size;
+    const int *tiles = state->cell_tiles + y * state->output_width;
+    for (int x=0; x<state->output_width; x++)
+      memcpy(&row[x * component_cnt], &model->tile_pixels[tiles[x] * tile_size], component_cnt);
+  }
 
- CLEANUP:
-  p("wfc__add_rotated_tiles: error\n");
-  for (int i=tile_idx; i<tile_idx*4; i++)
-    wfc_img_destroy(tiles[i].image);
+  return 1;
+}
+
+int wfc_rasterize(const struct wfc *wfc, unsigned char *pixels, int stride)
+{
+  return wfc_state_rasterize(wfc->state, pixels, stride);
+}
+
+// Sizes of the allocations of models and states, for wfc_estimate_memory,
+// memory caps and wfc_stats
+
+// Tiles and their pixels
+static size_t wfc__tile_bytes(int tile_cnt, int tile_width, int tile_height, int component_cnt)
+{
+  return (size_t)tile_cnt * (sizeof(struct wfc__tile) + (size_t)tile_width * tile_height * component_cnt);
+}
+
+// allowed_tiles, or lists of neighbour_cnt neighbours, with the initial
+// supports and frequency terms
+static size_t wfc__rule_bytes(int tile_cnt, int neighbour_lists, long long neighbour_cnt)
+{
+  size_t rule_bytes;
+  if (neighbour_lists)
+    rule_bytes = sizeof(int) * ((size_t)neighbour_cnt + (size_t)4 * tile_cnt + 1);
+  else
+    rule_bytes = sizeof(uint64_t) * 4 * (size_t)tile_cnt * wfc__word_cnt(tile_cnt);
+  return rule_bytes + (size_t)tile_cnt * (sizeof(int) * 4 + sizeof(double));
+}
+
+static size_t wfc__model_bytes(const struct wfc_model *model)
+{
+  long long neighbour_cnt = model->neighbours != NULL ? model->neighbour_offsets[4 * model->tile_cnt] : 0;
+  return sizeof(*model) +
+         wfc__tile_bytes(model->tile_cnt, model->tile_width, model->tile_height, model->component_cnt) +
+         wfc__rule_bytes(model->tile_cnt, model->neighbours != NULL, neighbour_cnt);
+}
+
+// Cells and their tiles, once more for the template
+static size_t wfc__cell_bytes(int cell_cnt, int tile_word_cnt)
+{
+  return (size_t)cell_cnt * (sizeof(struct wfc__cell) + sizeof(uint64_t) * tile_word_cnt);
+}
+
+// cell_tiles and the heap
+static size_t wfc__heap_bytes(int cell_cnt)
+{
+  return (size_t)cell_cnt * (sizeof(int) * 4 + sizeof(unsigned char));
+}
+
+// Props and their pending flags
+static size_t wfc__prop_bytes(int cell_cnt)
+{
+  return (size_t)cell_cnt * 4 * (sizeof(struct wfc__prop) + sizeof(unsigned char));
+}
+
+// Supports and bans of support propagation, the template of supports takes
+// another cell_cnt * tile_cnt * 4 ints
+static size_t wfc__support_bytes(int cell_cnt, int tile_cnt)
+{
+  return (size_t)cell_cnt * tile_cnt * (sizeof(int) * 4 + sizeof(struct wfc__ban));
+}
+
+// State with scan propagation, without template and backtracking
+static size_t wfc__state_bytes(int cell_cnt, int tile_word_cnt)
+{
+  return sizeof(struct wfc_state) + wfc__cell_bytes(cell_cnt, tile_word_cnt) +
+         wfc__heap_bytes(cell_cnt) + wfc__prop_bytes(cell_cnt) +
+         sizeof(uint64_t) * 2 * tile_word_cnt;
+}
 
+// Return 1 if extra_bytes more for the state keep the state and its model
+// within the model's memory_cap. The backtracking trail is counted as it
+// is, it grows during runs.
+static int wfc__within_cap(const struct wfc_state *state, size_t extra_bytes)
+{
+  const struct wfc_model *model = state->model;
+  if (model->memory_cap == 0)
+    return 1;
+
+  size_t bytes = wfc__model_bytes(model) + wfc__state_bytes(state->cell_cnt, model->tile_word_cnt) + extra_bytes;
+  if (state->supports != NULL)
+    bytes += wfc__support_bytes(state->cell_cnt, model->tile_cnt);
+  if (state->template_cells != NULL)
+    bytes += wfc__cell_bytes(state->cell_cnt, model->tile_word_cnt);
+  if (state->template_supports != NULL)
+    bytes += sizeof(*state->template_supports) * 4 * (size_t)state->cell_cnt * model->tile_cnt;
+  bytes += sizeof(*state->decisions) * state->decision_cap + sizeof(*state->trail) * state->trail_cap;
+
+  return bytes <= model->memory_cap;
+}
+
+// Fills stats with the counters of the state and its model, and the memory
+// they hold in the current layout
+//
+// Return 0, with stats zeroed, without WFC_USE_STATS
+int wfc_state_stats(const struct wfc_state *state, struct wfc_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+#ifdef WFC_USE_STATS
+  const struct wfc_model *model = state->model;
+  int cell_cnt = state->cell_cnt;
+  int word_cnt = model->tile_word_cnt;
+
+  *stats = state->stats;
+  stats->tiles_ns = model->stats.tiles_ns;
+  stats->rules_ns = model->stats.rules_ns;
+  stats->tile_cnt = model->tile_cnt;
+
+  stats->cell_bytes = wfc__cell_bytes(cell_cnt, word_cnt) + wfc__heap_bytes(cell_cnt);
+  if (state->template_cells != NULL)
+    stats->cell_bytes += wfc__cell_bytes(cell_cnt, word_cnt);
+
+  stats->prop_bytes = wfc__prop_bytes(cell_cnt);
+  if (state->supports != NULL)
+    stats->prop_bytes += wfc__support_bytes(cell_cnt, model->tile_cnt);
+  if (state->template_supports != NULL)
+    stats->prop_bytes += sizeof(*state->template_supports) * 4 * (size_t)cell_cnt * model->tile_cnt;
+
+  stats->rule_bytes = wfc__model_bytes(model) - sizeof(*model) -
+                      wfc__tile_bytes(model->tile_cnt, model->tile_width, model->tile_height, model->component_cnt);
+
+  stats->backtrack_bytes = sizeof(*state->decisions) * state->decision_cap +
+                           sizeof(*state->trail) * state->trail_cap;
+  return 1;
+#else
+  (void)state;
   return 0;
+#endif
 }
 
-// Return unique tiles with frequencies
-// Return 0 on error, non-0 on success
-static int wfc__remove_duplicate_tiles(struct wfc__tile **tiles, int *tile_cnt)
-{
-  int unique_cnt = 1;
-  for (int j=1; j<*tile_cnt; j++) {
-    int unique = 1;
-    for (int k=0; k<unique_cnt; k++) {
-      if (wfc__img_cmp((*tiles)[j].image, (*tiles)[k].image)) {
-        unique = 0;
-        (*tiles)[k].freq++;
-        break;
+int wfc_stats(const struct wfc *wfc, struct wfc_stats *stats)
+{
+  return wfc_state_stats(wfc->state, stats);
+}
+
+// Return NULL on error
+struct wfc_image *wfc_state_output_image(struct wfc_state *state)
+{
+  int component_cnt = state->model->component_cnt;
+  size_t tile_size = (size_t)state->model->tile_width * state->model->tile_height * component_cnt;
+  struct wfc_image *image = wfc_img_create(state->output_width, state->output_height, component_cnt);
+  if (image == NULL) {
+    p("wfc_state_output_image: error\n");
+    return 0;
+  }
+
+  if (wfc_state_rasterize(state, image->data, 0))
+    return image;
+
+  // Not collapsed, average the remaining tiles of each cell
+
+  for (int y=0; y<state->output_height; y++) {
+    for (int x=0; x<state->output_width; x++) {
+      struct wfc__cell *cell = &( state->cells[y * state->output_width + x] );
+
+      double components[4] = {0, 0, 0, 0};
+      for (int w=0; w<state->model->tile_word_cnt; w++) {
+        for (uint64_t bits=cell->tiles[w]; bits; bits&=bits-1) {
+          const unsigned char *pixel = &( state->model->tile_pixels[(w * WFC__WORD_BITS + wfc__ctz(bits)) * tile_size] );
+          for (int j=0; j<component_cnt; j++) {
+            components[j] += pixel[j];
+          }
+        }
       }
-    }
 
-    if (unique) {
-      if (unique_cnt != j) {
-        struct wfc__tile tmp = (*tiles)[unique_cnt];
-        (*tiles)[unique_cnt] = (*tiles)[j];
-        (*tiles)[j] = tmp;
+      for (int i=0; i<component_cnt; i++) {
+        image->data[y * state->output_width * component_cnt + x * component_cnt + i] = (unsigned char)(components[i] / cell->tile_cnt);
       }
-      unique_cnt++;
     }
   }
 
-  for (int i=unique_cnt; i<*tile_cnt; i++)
-    wfc_img_destroy((*tiles)[i].image);
+  return image;
+}
+
+// Return NULL on error
+struct wfc_image *wfc_output_image(struct wfc *wfc)
+{
+  return wfc_state_output_image(wfc->state);
+}
+
+#ifdef WFC_USE_STB
+
+// Return 0 on error, non-0 on success
+// dep: stb
+int wfc_state_export(struct wfc_state *state, const char *filename)
+{
+  struct wfc_image *image = wfc_state_output_image(state);
+  if (image == NULL)
+    return 0;
+
+  int rv = wfc_img_save(image, filename);
+  wfc_img_destroy(image);
+
+  return rv;
+}
+
+// Return 0 on error, non-0 on success
+// dep: stb
+int wfc_export(struct wfc *wfc, const char *filename)
+{
+  return wfc_state_export(wfc->state, filename);
+}
+
+// Return 0 on error, non-0 on success
+// dep: stb
+int wfc_export_tiles(struct wfc *wfc, const char *path)
+{
+  char filename[128];
+  for (int i=0; i<wfc->model->tile_cnt; i++) {
+    sprintf(filename, "%s/%d.png", path, i);
+    struct wfc_image tile_image = wfc__tile_image(wfc->model->tile_pixels, i, wfc->model->tile_width,
+                                                  wfc->model->tile_height, wfc->model->component_cnt);
+    if (wfc_img_save(&tile_image, filename) == 0) {
+      p("wfc_export_tiles: error\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#endif // WFC_USE_STB
+
+// Unique tiles found so far, in order of first occurrence, with an open
+// addressing hash table over their pixels
+struct wfc__tile_set {
+  struct wfc__tile *tiles;
+  unsigned char *pixels;       // Tile-major pixels of the tiles, tile_cap long
+  int tile_width;
+  int tile_height;
+  int component_cnt;
+  uint64_t *hashes;            // Hash of each tile's pixels
+  int tile_cnt;
+  int tile_cap;
+  int *slots;                  // Indices into tiles, -1 if empty
+  int slot_cnt;                // Power of 2, more than twice tile_cnt
+  struct wfc_image *scratch;   // Transformed tile before it's looked up
+};
+
+// FNV-1a, h is the hash of the preceding bytes
+static uint64_t wfc__hash_bytes(uint64_t h, const unsigned char *data, size_t size)
+{
+  for (size_t i=0; i<size; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define WFC__HASH_SEED 0xcbf29ce484222325ULL
+
+// Hash of the tile_width x tile_height window at (x, y) of the image. Equal
+// to the hash of a tile image with the same pixels.
+static uint64_t wfc__hash_window(struct wfc_image *image, int x, int y, int tile_width, int tile_height)
+{
+  size_t row_size = (size_t)tile_width * image->component_cnt;
+  uint64_t h = WFC__HASH_SEED;
+  for (int i=0; i<tile_height; i++)
+    h = wfc__hash_bytes(h, &image->data[((size_t)(y+i) * image->width + x) * image->component_cnt], row_size);
+  return h;
+}
+
+// Return 1 if the window at (x, y) of the image has the same pixels as
+// the tile image
+static int wfc__window_cmp(struct wfc_image *image, int x, int y, struct wfc_image *tile_image)
+{
+  size_t row_size = (size_t)tile_image->width * image->component_cnt;
+  for (int i=0; i<tile_image->height; i++) {
+    if (memcmp(&image->data[((size_t)(y+i) * image->width + x) * image->component_cnt],
+               &tile_image->data[i * row_size],
+               row_size) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+static void wfc__destroy_tile_set(struct wfc__tile_set *set)
+{
+  free(set->tiles);
+  free(set->pixels);
+  free(set->hashes);
+  free(set->slots);
+  wfc_img_destroy(set->scratch);
+  set->tiles = NULL;
+  set->pixels = NULL;
+  set->hashes = NULL;
+  set->slots = NULL;
+  set->scratch = NULL;
+  set->tile_cnt = 0;
+}
 
-  struct wfc__tile *unique_tiles = realloc(*tiles, sizeof(**tiles) * unique_cnt);
-  if (unique_tiles == NULL) {
-    p("wfc__remove_duplicate_tiles: error\n");
+// Return 0 on error
+static int wfc__create_tile_set(struct wfc__tile_set *set, int tile_cap, int tile_width, int tile_height, int component_cnt)
+{
+  set->tile_cnt = 0;
+  set->tile_cap = tile_cap;
+  set->tile_width = tile_width;
+  set->tile_height = tile_height;
+  set->component_cnt = component_cnt;
+  set->slot_cnt = 1;
+  while (set->slot_cnt <= tile_cap * 2)
+    set->slot_cnt *= 2;
+
+  set->tiles = malloc(sizeof(*set->tiles) * tile_cap);
+  set->pixels = malloc((size_t)tile_cap * tile_width * tile_height * component_cnt);
+  set->hashes = malloc(sizeof(*set->hashes) * tile_cap);
+  set->slots = malloc(sizeof(*set->slots) * set->slot_cnt);
+  set->scratch = wfc_img_create(tile_width, tile_height, component_cnt);
+  if (set->tiles == NULL || set->pixels == NULL || set->hashes == NULL ||
+      set->slots == NULL || set->scratch == NULL) {
+    p("wfc__create_tile_set: error\n");
+    wfc__destroy_tile_set(set);
     return 0;
   }
 
-  *tiles = unique_tiles;
-  *tile_cnt = unique_cnt;
+  for (int i=0; i<set->slot_cnt; i++)
+    set->slots[i] = -1;
+
+  return 1;
+}
+
+// Return the slot of the tile with the hash which has the same pixels as
+// the window at (x, y) of the image. Return the empty slot where such
+// a tile would go if there is none.
+static int wfc__tile_set_find(struct wfc__tile_set *set, uint64_t hash, struct wfc_image *image, int x, int y)
+{
+  int mask = set->slot_cnt - 1;
+  int slot = (int)(hash & mask);
+  while (set->slots[slot] != -1) {
+    int tile_idx = set->slots[slot];
+    if (set->hashes[tile_idx] == hash) {
+      struct wfc_image tile_image = wfc__tile_image(set->pixels, tile_idx, set->tile_width, set->tile_height, set->component_cnt);
+      if (wfc__window_cmp(image, x, y, &tile_image))
+        return slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Adds the window at (x, y) of the image, not yet in the set, as a tile
+// in the empty slot
+//
+// Return 0 on error
+static int wfc__tile_set_insert(struct wfc__tile_set *set, int slot, uint64_t hash, struct wfc_image *image, int x, int y, int freq)
+{
+  size_t row_size = (size_t)set->tile_width * set->component_cnt;
+  size_t tile_size = row_size * set->tile_height;
+
+  if (set->tile_cnt == set->tile_cap) {
+    int cap = set->tile_cap * 2;
+    struct wfc__tile *tiles = realloc(set->tiles, sizeof(*tiles) * cap);
+    if (tiles != NULL)
+      set->tiles = tiles;
+    unsigned char *pixels = realloc(set->pixels, tile_size * cap);
+    if (pixels != NULL)
+      set->pixels = pixels;
+    uint64_t *hashes = realloc(set->hashes, sizeof(*hashes) * cap);
+    if (hashes != NULL)
+      set->hashes = hashes;
+    if (tiles == NULL || pixels == NULL || hashes == NULL)
+      return 0;
+    set->tile_cap = cap;
+  }
+
+  int tile_idx = set->tile_cnt;
+  (set->tile_cnt)++;
+  for (int i=0; i<set->tile_height; i++) {
+    memcpy(&set->pixels[tile_idx * tile_size + i * row_size],
+           &image->data[((size_t)(y+i) * image->width + x) * image->component_cnt],
+           row_size);
+  }
+  set->tiles[tile_idx].freq = freq;
+  set->hashes[tile_idx] = hash;
+  set->slots[slot] = tile_idx;
+
+  // Keep the load factor below 1/2
+  if (set->tile_cnt * 2 >= set->slot_cnt) {
+    int slot_cnt = set->slot_cnt * 2;
+    int *slots = malloc(sizeof(*slots) * slot_cnt);
+    if (slots == NULL)
+      return 0;
+
+    for (int i=0; i<slot_cnt; i++)
+      slots[i] = -1;
+    for (int i=0; i<set->tile_cnt; i++) {
+      int s = (int)(set->hashes[i] & (slot_cnt - 1));
+      while (slots[s] != -1)
+        s = (s + 1) & (slot_cnt - 1);
+      slots[s] = i;
+    }
+
+    free(set->slots);
+    set->slots = slots;
+    set->slot_cnt = slot_cnt;
+  }
+
+  return 1;
+}
+
+// Adds the tile_width x tile_height window at (x, y) of the image
+// occurring freq times
+//
+// Return 0 on error
+static int wfc__tile_set_add(struct wfc__tile_set *set, struct wfc_image *image, int x, int y, int freq)
+{
+  uint64_t hash = wfc__hash_window(image, x, y, set->tile_width, set->tile_height);
+  int slot = wfc__tile_set_find(set, hash, image, x, y);
+  if (set->slots[slot] != -1) {
+    set->tiles[ set->slots[slot] ].freq += freq;
+    return 1;
+  }
+
+  return wfc__tile_set_insert(set, slot, hash, image, x, y, freq);
+}
+
+// Adds all tile_width x tile_height windows of the image
+//
+// Return 0 on error
+static int wfc__add_overlapping_images(struct wfc__tile_set *set, struct wfc_image *image, int xcnt, int ycnt)
+{
+  for (int y=0; y<ycnt; y++)
+    for (int x=0; x<xcnt; x++) {
+      if (!wfc__tile_set_add(set, image, x, y, 1)) {
+        p("wfc__add_overlapping_images: error\n");
+        return 0;
+      }
+    }
+
+  return 1;
+}
+
+// Return a copy of tile frequencies, which transforms of the tiles use
+// while adding to them. NULL on error.
+static int *wfc__copy_freqs(struct wfc__tile_set *set)
+{
+  int *freqs = malloc(sizeof(*freqs) * set->tile_cnt);
+  if (freqs == NULL)
+    return NULL;
+
+  for (int i=0; i<set->tile_cnt; i++)
+    freqs[i] = set->tiles[i].freq;
+
+  return freqs;
+}
+
+// Adds flips of all tiles in the set. Each unique tile stands for all of
+// its occurrences, so it is flipped once.
+//
+// Return 0 on error, non-0 on success
+// flip_direction: 0 - horizontal, 1 vertical
+static int wfc__add_flipped_images(struct wfc__tile_set *set, int flip_direction)
+{
+  int cnt = set->tile_cnt;
+  int *freqs = wfc__copy_freqs(set);
+  if (freqs == NULL)
+    goto CLEANUP;
+
+  for (int i=0; i<cnt; i++) {
+    struct wfc_image src = wfc__tile_image(set->pixels, i, set->tile_width, set->tile_height, set->component_cnt);
+    if (flip_direction == 0)
+      wfc__img_flip_horizontally(set->scratch, &src);
+    else
+      wfc__img_flip_vertically(set->scratch, &src);
+    if (!wfc__tile_set_add(set, set->scratch, 0, 0, freqs[i]))
+      goto CLEANUP;
+  }
+
+  free(freqs);
+  return 1;
+
+ CLEANUP:
+  p("wfc__add_flipped_tiles: error\n");
+  free(freqs);
+  return 0;
+}
+
+// Adds n*90deg rotations of all tiles in the set. All tiles have the same
+// size, so tiles that aren't square are only rotated by 180deg.
+//
+// Return 0 on error, non-0 on success
+static int wfc__add_rotated_images(struct wfc__tile_set *set)
+{
+  int cnt = set->tile_cnt;
+  int *freqs = wfc__copy_freqs(set);
+  if (freqs == NULL)
+    goto CLEANUP;
+
+  for (int i=0; i<cnt; i++) {
+    for (int j=0; j<3; j++) {
+      if (j != 1 && set->tile_width != set->tile_height)
+        continue;
+
+      struct wfc_image src = wfc__tile_image(set->pixels, i, set->tile_width, set->tile_height, set->component_cnt);
+      wfc__img_rotate90(set->scratch, &src, j+1);
+      if (!wfc__tile_set_add(set, set->scratch, 0, 0, freqs[i]))
+        goto CLEANUP;
+    }
+  }
 
+  free(freqs);
   return 1;
+
+ CLEANUP:
+  p("wfc__add_rotated_tiles: error\n");
+  free(freqs);
+  return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -813,18 +1945,21 @@ static void wfc__destroy_props(struct wfc__prop *props)
 
 static struct wfc__prop *wfc__create_props(int cell_cnt)
 {
-  struct wfc__prop *props = malloc(sizeof(*props) * cell_cnt * WFC_MAX_PROP_CNT);
+  struct wfc__prop *props = malloc(sizeof(*props) * cell_cnt * 4);
   return props;
 }
 
 static void wfc__destroy_cells(struct wfc__cell *cells, int cell_cnt)
 {
+  if (cells == NULL)
+    return;
+
   free(cells[0].tiles);
   free(cells);
 }
 
 // Return NULL on error
-static struct wfc__cell *wfc__create_cells(int cell_cnt, int tile_cnt)
+static struct wfc__cell *wfc__create_cells(int cell_cnt, int tile_word_cnt)
 {
   struct wfc__cell *cells = malloc(sizeof(*cells) * cell_cnt);
   if (cells == NULL)
@@ -833,12 +1968,12 @@ static struct wfc__cell *wfc__create_cells(int cell_cnt, int tile_cnt)
   for (int i=0; i<cell_cnt; i++)
     cells[i].tiles = NULL;
 
-  cells[0].tiles = malloc(sizeof(*(cells[0].tiles)) * tile_cnt * cell_cnt);
-  for (int i=1; i<cell_cnt; i++) {
-    cells[i].tiles = cells[0].tiles + i * tile_cnt;
-    if (cells[i].tiles == NULL)
-      goto CLEANUP;
-  }
+  cells[0].tiles = malloc(sizeof(*(cells[0].tiles)) * tile_word_cnt * cell_cnt);
+  if (cells[0].tiles == NULL)
+    goto CLEANUP;
+
+  for (int i=1; i<cell_cnt; i++)
+    cells[i].tiles = cells[0].tiles + (size_t)i * tile_word_cnt;
 
   return cells;
 
@@ -848,332 +1983,2819 @@ static struct wfc__cell *wfc__create_cells(int cell_cnt, int tile_cnt)
   return NULL;
 }
 
-static void wfc__destroy_tiles(struct wfc__tile *tiles, int tile_cnt)
+static void wfc__destroy_allowed_tiles(uint64_t *allowed_tiles[4])
 {
-  if (tiles == NULL)
-    return;
-
-  for (int i=0; i<tile_cnt; i++) {
-    struct wfc__tile *t = &tiles[i];
-    wfc_img_destroy(t->image);
-  }
-
-  free(tiles);
+  free(allowed_tiles[0]);
+  for (int i=0; i<4; i++)
+    allowed_tiles[i] = NULL;
 }
 
+// Allocates zeroed rules, tile_cnt rows of tile_word_cnt words per direction
+//
 // Return 0 on error
-static struct wfc__tile *wfc__create_tiles(int tile_cnt)
+static int wfc__create_allowed_tiles(uint64_t *allowed_tiles[4], int tile_cnt, int tile_word_cnt)
 {
-  struct wfc__tile *tiles = malloc(sizeof(*tiles) * tile_cnt);
-  if (tiles == NULL)
+  size_t row_cnt = (size_t)tile_cnt * tile_word_cnt;
+  allowed_tiles[0] = calloc(row_cnt * 4, sizeof(*allowed_tiles[0]));
+  if (allowed_tiles[0] == NULL)
     goto CLEANUP;
 
-  for (int i=0; i<tile_cnt; i++) {
-    tiles[i].image = NULL;
-    tiles[i].freq = 0;
-  }
+  for (int i=1; i<4; i++)
+    allowed_tiles[i] = allowed_tiles[0] + i * row_cnt;
 
-  return tiles;
+  return 1;
 
  CLEANUP:
-  p("wfc__create_tiles: error\n");
-  wfc__destroy_tiles(tiles, tile_cnt);
+  p("wfc__create_allowed_tiles: error\n");
+  wfc__destroy_allowed_tiles(allowed_tiles);
 
-  return NULL;
+  return 0;
 }
 
-static void wfc__destroy_allowed_tiles(int *allowed_tiles[4])
+// Lists take 32 bits per allowed pair of tiles against 1 bit per pair for
+// rows, and scanning a row costs about as much as a few list entries. Lists
+// are used when at most 1 in 64 pairs is allowed.
+static int wfc__use_neighbour_lists(int tile_cnt, size_t neighbour_cnt)
 {
-  free(allowed_tiles[0]);
+  return neighbour_cnt * 64 <= (size_t)4 * tile_cnt * tile_cnt;
 }
 
+static void wfc__destroy_neighbours(struct wfc_model *model)
+{
+  free(model->neighbours);
+  free(model->neighbour_offsets);
+  model->neighbours = NULL;
+  model->neighbour_offsets = NULL;
+}
+
+// Allocates lists of neighbour_cnt neighbours in all, offsets are left to
+// the caller
+//
 // Return 0 on error
-static int wfc__create_allowed_tiles(int *allowed_tiles[4], int tile_cnt)
+static int wfc__create_neighbours(struct wfc_model *model, size_t neighbour_cnt)
 {
-  allowed_tiles[0] = malloc(sizeof(*allowed_tiles[0]) * tile_cnt * tile_cnt * 4);
-  for (int i=1; i<4; i++)
-    allowed_tiles[i] = allowed_tiles[0] + i * tile_cnt * tile_cnt;
+  model->neighbour_offsets = malloc(sizeof(*model->neighbour_offsets) * ((size_t)4 * model->tile_cnt + 1));
+  model->neighbours = malloc(sizeof(*model->neighbours) * (neighbour_cnt > 0 ? neighbour_cnt : 1));
+  if (model->neighbour_offsets == NULL || model->neighbours == NULL) {
+    p("wfc__create_neighbours: error\n");
+    wfc__destroy_neighbours(model);
+    return 0;
+  }
 
   return 1;
+}
 
- CLEANUP:
-  p("wfc__create_allowed_tiles: error\n");
-  wfc__destroy_allowed_tiles(allowed_tiles);
+static void wfc__destroy_heap(struct wfc_state *state)
+{
+  free(state->heap);
+  free(state->cell_dirty);
+}
 
-  return 0;
+// Return 0 on error
+static int wfc__create_heap(struct wfc_state *state)
+{
+  state->heap = malloc(sizeof(*state->heap) * state->cell_cnt * 3);
+  state->cell_dirty = calloc(state->cell_cnt, sizeof(*state->cell_dirty));
+  if (state->heap == NULL || state->cell_dirty == NULL) {
+    p("wfc__create_heap: error\n");
+    return 0;
+  }
+
+  state->heap_pos = state->heap + state->cell_cnt;
+  state->dirty = state->heap_pos + state->cell_cnt;
+  state->heap_cnt = 0;
+  state->dirty_cnt = 0;
+
+  return 1;
 }
 
-static void wfc__add_prop(struct wfc *wfc, int src_cell_idx, int dst_cell_idx, enum wfc__direction direction)
+static double wfc__heap_key(struct wfc_state *state, int heap_idx)
 {
-  // TODO: check for wfc->prop_cnt == WFC_MAX_PROP_CNT
+  struct wfc__cell *cell = &( state->cells[ state->heap[heap_idx] ] );
+  return cell->entropy + cell->noise;
+}
 
-  struct wfc__prop *p = &( wfc->props[wfc->prop_cnt] );
-  (wfc->prop_cnt)++;
-  p->src_cell_idx = src_cell_idx;
-  p->dst_cell_idx = dst_cell_idx;
-  p->direction = direction;
+static void wfc__heap_swap(struct wfc_state *state, int a, int b)
+{
+  int tmp = state->heap[a];
+  state->heap[a] = state->heap[b];
+  state->heap[b] = tmp;
+  state->heap_pos[ state->heap[a] ] = a;
+  state->heap_pos[ state->heap[b] ] = b;
 }
 
-// add prop to update cell above the cell_idx
-static void wfc__add_prop_up(struct wfc *wfc, int src_cell_idx)
+static void wfc__heap_sift_up(struct wfc_state *state, int i)
+{
+  while (i > 0) {
+    int parent = (i-1) / 2;
+    if (wfc__heap_key(state, parent) <= wfc__heap_key(state, i))
+      break;
+    wfc__heap_swap(state, i, parent);
+    i = parent;
+  }
+}
+
+static void wfc__heap_sift_down(struct wfc_state *state, int i)
+{
+  while (1) {
+    int min = i;
+    int left = 2*i + 1;
+    int right = left + 1;
+    if (left < state->heap_cnt && wfc__heap_key(state, left) < wfc__heap_key(state, min))
+      min = left;
+    if (right < state->heap_cnt && wfc__heap_key(state, right) < wfc__heap_key(state, min))
+      min = right;
+    if (min == i)
+      break;
+    wfc__heap_swap(state, i, min);
+    i = min;
+  }
+}
+
+// Re-sorts the cell after its entropy changed, removes it if collapsed
+static void wfc__heap_update(struct wfc_state *state, int cell_idx)
+{
+  int i = state->heap_pos[cell_idx];
+  if (i == -1) {
+    if (state->cells[cell_idx].tile_cnt <= 1)
+      return;
+
+    // Uncollapsed by backtracking
+    i = state->heap_cnt;
+    (state->heap_cnt)++;
+    state->heap[i] = cell_idx;
+    state->heap_pos[cell_idx] = i;
+    wfc__heap_sift_up(state, i);
+    return;
+  }
+
+  if (state->cells[cell_idx].tile_cnt == 1) {
+    state->heap_pos[cell_idx] = -1;
+    (state->heap_cnt)--;
+    if (i == state->heap_cnt)
+      return;
+    state->heap[i] = state->heap[state->heap_cnt];
+    state->heap_pos[ state->heap[i] ] = i;
+  }
+
+  int moved_cell_idx = state->heap[i];
+  wfc__heap_sift_up(state, i);
+  wfc__heap_sift_down(state, state->heap_pos[moved_cell_idx]);
+}
+
+// Marks the cell for an entropy and heap update in wfc__next_cell
+static void wfc__touch_cell(struct wfc_state *state, int cell_idx)
+{
+  if (state->cell_dirty[cell_idx])
+    return;
+
+  state->cell_dirty[cell_idx] = 1;
+  state->dirty[state->dirty_cnt] = cell_idx;
+  (state->dirty_cnt)++;
+}
+
+static void wfc__init_heap(struct wfc_state *state)
+{
+  state->heap_cnt = 0;
+  for (int i=0; i<state->cell_cnt; i++) {
+    if (state->cells[i].tile_cnt == 1) {
+      state->heap_pos[i] = -1;
+    } else {
+      state->heap[state->heap_cnt] = i;
+      state->heap_pos[i] = state->heap_cnt;
+      (state->heap_cnt)++;
+    }
+  }
+
+  for (int i=state->heap_cnt/2 - 1; i>=0; i--)
+    wfc__heap_sift_down(state, i);
+}
+
+// Callers make sure the prop is not already pending, which bounds the
+// number of pending props to 4*cell_cnt
+static void wfc__add_prop(struct wfc_state *state, int src_cell_idx, int dst_cell_idx, enum wfc__direction direction)
+{
+  int prop_cap = state->cell_cnt * 4;
+  wfcassert(state->prop_cnt < prop_cap);
+
+  struct wfc__prop *p = &( state->props[(state->prop_head + state->prop_cnt) % prop_cap] );
+  (state->prop_cnt)++;
+  state->prop_pending[src_cell_idx*4 + direction] = 1;
+  p->src_cell_idx = src_cell_idx;
+  p->dst_cell_idx = dst_cell_idx;
+  p->direction = direction;
+}
+
+// add prop to update cell above the cell_idx
+static void wfc__add_prop_up(struct wfc_state *state, int src_cell_idx)
+{
+  if (src_cell_idx - state->output_width >= 0) {
+    wfc__add_prop(state, src_cell_idx, src_cell_idx - state->output_width, WFC_UP);
+  }
+}
+
+static void wfc__add_prop_down(struct wfc_state *state, int src_cell_idx)
+{
+  if (src_cell_idx + state->output_width < state->cell_cnt) {
+    wfc__add_prop(state, src_cell_idx, src_cell_idx + state->output_width, WFC_DOWN);
+  }
+}
+
+static void wfc__add_prop_left(struct wfc_state *state, int src_cell_idx)
+{
+  if (src_cell_idx % state->output_width != 0) {
+    wfc__add_prop(state, src_cell_idx, src_cell_idx - 1, WFC_LEFT);
+  }
+}
+
+static void wfc__add_prop_right(struct wfc_state *state, int src_cell_idx)
+{
+  if (src_cell_idx % state->output_width != state->output_width - 1) {
+    wfc__add_prop(state, src_cell_idx, src_cell_idx + 1, WFC_RIGHT);
+  }
+}
+
+// Computes state->support, the set of tiles enabled by the cell in the
+// direction. A tile is enabled if any of the cell's tiles allows it, so
+// the support is the union of the allowed rows of the cell's tiles.
+static WFC__INLINE void wfc__compute_support(struct wfc_state *state, int cell_idx, enum wfc__direction d, int word_cnt)
+{
+  const struct wfc_model *model = state->model;
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+  uint64_t *support = state->support;
+
+  memset(support, 0, sizeof(*support) * word_cnt);
+  for (int w=0; w<word_cnt; w++) {
+    for (uint64_t bits=cell->tiles[w]; bits; bits&=bits-1) {
+      int tile_idx = w * WFC__WORD_BITS + wfc__ctz(bits);
+      if (model->neighbours != NULL) {
+        size_t r = (size_t)d * model->tile_cnt + tile_idx;
+        for (int k=model->neighbour_offsets[r]; k<model->neighbour_offsets[r+1]; k++)
+          wfc__bit_set(support, model->neighbours[k]);
+      } else {
+        wfc__row_or(support, model->allowed_tiles[d] + (size_t)tile_idx * word_cnt, word_cnt);
+      }
+    }
+  }
+}
+
+// Checks whether particular prop is already added and pending, in which
+// case there is no point of adding the same prop again.
+//
+// 1 - prop is added, 0 - prop is not added
+static int wfc__is_prop_pending(struct wfc_state *state, int cell_idx, enum wfc__direction d) {
+  WFC__STAT(state->stats.prop_skip_cnt += state->prop_pending[cell_idx*4 + d]);
+  return state->prop_pending[cell_idx*4 + d];
+}
+
+// Drops all pending props, e.g., those left after a contradiction
+static void wfc__clear_props(struct wfc_state *state)
+{
+  int prop_cap = state->cell_cnt * 4;
+  for (int i=0; i<state->prop_cnt; i++) {
+    struct wfc__prop *p = &( state->props[(state->prop_head + i) % prop_cap] );
+    state->prop_pending[p->src_cell_idx*4 + p->direction] = 0;
+  }
+  state->prop_cnt = 0;
+  state->prop_head = 0;
+}
+
+// Updates the cell's frequency sums after the tile was removed from it
+// (sign -1) or restored (sign 1). The entropy is updated from the sums
+// later, see wfc__update_entropy.
+static void wfc__account_tile(const struct wfc_model *model, struct wfc__cell *cell, int tile_idx, int sign)
+{
+  cell->sum_freqs += sign * model->tiles[tile_idx].freq;
+  cell->sum_freq_log_freqs += sign * model->freq_log_freqs[tile_idx];
+}
+
+// With p = freq/sum_freqs of each tile, the entropy -sum(p*log(p)) is
+// log(sum_freqs) - sum(freq*log(freq))/sum_freqs
+static void wfc__update_entropy(struct wfc__cell *cell)
+{
+  if (cell->sum_freqs > 0)
+    cell->entropy = log(cell->sum_freqs) - cell->sum_freq_log_freqs / cell->sum_freqs;
+  else
+    cell->entropy = 0.0;
+}
+
+// Sets the cell's tile count, keeping collapsed_cell_cnt up to date. A
+// cell counts as collapsed once it has at most one tile left.
+static void wfc__set_tile_cnt(struct wfc_state *state, int cell_idx, int tile_cnt)
+{
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+  if (cell->tile_cnt > 1 && tile_cnt <= 1)
+    state->collapsed_cell_cnt++;
+  else if (cell->tile_cnt <= 1 && tile_cnt > 1)
+    state->collapsed_cell_cnt--;
+
+  if (tile_cnt == 1)
+    state->cell_tiles[cell_idx] = wfc__first_bit(cell->tiles, state->model->tile_word_cnt);
+  else if (cell->tile_cnt == 1)
+    state->cell_tiles[cell_idx] = -1;
+
+  cell->tile_cnt = tile_cnt;
+  wfc__touch_cell(state, cell_idx);
+}
+
+// Records the removal of the tile from the cell. Nothing is recorded when
+// there is no decision to undo.
+static void wfc__save_removal(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  if (state->decision_cnt == 0)
+    return;
+
+  if (state->trail_cnt == state->trail_cap) {
+    int cap = state->trail_cap ? state->trail_cap * 2 : state->cell_cnt;
+    struct wfc__change *trail = realloc(state->trail, sizeof(*trail) * cap);
+    if (trail == NULL) {
+      // The change can't be undone, and so neither can the decisions
+      p("wfc__save_removal: error\n");
+      state->decision_cnt = 0;
+      state->trail_cnt = 0;
+      return;
+    }
+    state->trail = trail;
+    state->trail_cap = cap;
+  }
+
+  struct wfc__change *c = &( state->trail[state->trail_cnt] );
+  (state->trail_cnt)++;
+  c->cell_idx = cell_idx;
+  c->tile_idx = tile_idx;
+}
+
+// Records the collapse so that it can be undone. When backtrack_depth
+// decisions are recorded, the older half of them is kept for good.
+static void wfc__push_decision(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  if (state->decisions == NULL)
+    return;
+
+  if (state->decision_cnt == state->decision_cap) {
+    int drop_cnt = (state->decision_cnt + 1) / 2;
+    int drop_trail_cnt = drop_cnt < state->decision_cnt ? state->decisions[drop_cnt].trail_cnt : state->trail_cnt;
+
+    state->decision_cnt -= drop_cnt;
+    state->trail_cnt -= drop_trail_cnt;
+    memmove(state->decisions, state->decisions + drop_cnt, sizeof(*state->decisions) * state->decision_cnt);
+    memmove(state->trail, state->trail + drop_trail_cnt, sizeof(*state->trail) * state->trail_cnt);
+    for (int i=0; i<state->decision_cnt; i++)
+      state->decisions[i].trail_cnt -= drop_trail_cnt;
+  }
+
+  struct wfc__decision *d = &( state->decisions[state->decision_cnt] );
+  (state->decision_cnt)++;
+  d->cell_idx = cell_idx;
+  d->tile_idx = tile_idx;
+  d->trail_cnt = state->trail_cnt;
+}
+
+// Updates tiles in the destination cell to those that are allowed by the source cell
+// and propagate updates
+//
+// Return 0 on error
+static WFC__INLINE int wfc__propagate_prop_words(struct wfc_state *state, struct wfc__prop *p, int word_cnt)
+{
+  struct wfc__cell *dst_cell = &( state->cells[ p->dst_cell_idx ] );
+
+  wfc__compute_support(state, p->src_cell_idx, p->direction, word_cnt);
+
+  // Keep only the destination tiles enabled by the source cell
+  if (wfc__row_subset(dst_cell->tiles, state->support, word_cnt))
+    return 1;
+
+  uint64_t *removed = state->support + word_cnt;
+  wfc__row_and(dst_cell->tiles, state->support, removed, word_cnt);
+  int removed_cnt = wfc__row_popcount(removed, word_cnt);
+  WFC__STAT(state->stats.ban_cnt += removed_cnt);
+  for (int w=0; w<word_cnt; w++) {
+    for (uint64_t bits=removed[w]; bits; bits&=bits-1) {
+      int tile_idx = w * WFC__WORD_BITS + wfc__ctz(bits);
+      wfc__save_removal(state, p->dst_cell_idx, tile_idx);
+      wfc__account_tile(state->model, dst_cell, tile_idx, -1);
+    }
+  }
+
+  wfc__set_tile_cnt(state, p->dst_cell_idx, dst_cell->tile_cnt - removed_cnt);
+
+  if (!dst_cell->tile_cnt) {
+    return 0;
+  }
+
+  if (p->direction != WFC_DOWN && !wfc__is_prop_pending(state, p->dst_cell_idx, WFC_UP)) wfc__add_prop_up(state, p->dst_cell_idx);
+  if (p->direction != WFC_UP && !wfc__is_prop_pending(state, p->dst_cell_idx, WFC_DOWN)) wfc__add_prop_down(state, p->dst_cell_idx);
+  if (p->direction != WFC_RIGHT && !wfc__is_prop_pending(state, p->dst_cell_idx, WFC_LEFT)) wfc__add_prop_left(state, p->dst_cell_idx);
+  if (p->direction != WFC_LEFT && !wfc__is_prop_pending(state, p->dst_cell_idx, WFC_RIGHT)) wfc__add_prop_right(state, p->dst_cell_idx);
+
+  return 1;
+}
+
+// Tile sets of up to 64 and 128 tiles get their own copies of
+// wfc__propagate_prop_words, with domains and rows of one and two words
+// handled in registers
+//
+// Return 0 on error
+static int wfc__propagate_prop(struct wfc_state *state, struct wfc__prop *p)
+{
+  switch (state->model->tile_word_cnt) {
+  case 1:
+    return wfc__propagate_prop_words(state, p, 1);
+  case 2:
+    return wfc__propagate_prop_words(state, p, 2);
+  default:
+    return wfc__propagate_prop_words(state, p, state->model->tile_word_cnt);
+  }
+}
+
+// Return index of the neighbouring cell in the direction, -1 if there is none
+static int wfc__neighbour(struct wfc_state *state, int cell_idx, enum wfc__direction d)
+{
+  switch (d) {
+  case WFC_UP:
+    return cell_idx - state->output_width >= 0 ? cell_idx - state->output_width : -1;
+  case WFC_DOWN:
+    return cell_idx + state->output_width < state->cell_cnt ? cell_idx + state->output_width : -1;
+  case WFC_LEFT:
+    return cell_idx % state->output_width != 0 ? cell_idx - 1 : -1;
+  case WFC_RIGHT:
+    return cell_idx % state->output_width != state->output_width - 1 ? cell_idx + 1 : -1;
+  }
+  return -1;
+}
+
+// Queues the removal of the tile from the cell. Supports of a removed tile
+// are raised by tile_cnt, more than the decrements left, so that they never
+// reach zero again. wfc__unban lowers them back.
+static void wfc__push_ban(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  int tile_cnt = state->model->tile_cnt;
+  int *supports = &( state->supports[((size_t)cell_idx * tile_cnt + tile_idx) * 4] );
+  for (int d=0; d<4; d++)
+    supports[d] += tile_cnt;
+
+  struct wfc__ban *b = &( state->bans[state->ban_cnt] );
+  (state->ban_cnt)++;
+  b->cell_idx = cell_idx;
+  b->tile_idx = tile_idx;
+}
+
+// Removes the tile, which must be possible, from the cell
+//
+// Return 0 on error (contradiction)
+static int wfc__remove_tile(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+
+  wfc__save_removal(state, cell_idx, tile_idx);
+  wfc__bit_clear(cell->tiles, tile_idx);
+  wfc__account_tile(state->model, cell, tile_idx, -1);
+  wfc__set_tile_cnt(state, cell_idx, cell->tile_cnt - 1);
+  WFC__STAT(state->stats.ban_cnt++);
+
+  return cell->tile_cnt != 0;
+}
+
+// Removes the tile from the cell and queues the removal. The removal is
+// queued even on a contradiction, see wfc__propagate_bans.
+//
+// Return 0 on error (contradiction)
+static int wfc__ban(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  int rv = wfc__remove_tile(state, cell_idx, tile_idx);
+  wfc__push_ban(state, cell_idx, tile_idx);
+  return rv;
+}
+
+// Decrements supports of the tiles allowed by the banned tiles, and bans
+// the tiles that are left without support. After a contradiction the
+// remaining bans are still applied to supports, without banning more
+// tiles, so that backtracking can undo all of them.
+//
+// Return 0 on error (contradiction)
+static int wfc__propagate_bans(struct wfc_state *state)
+{
+  const struct wfc_model *model = state->model;
+  int tile_cnt = model->tile_cnt;
+  int word_cnt = model->tile_word_cnt;
+  int rv = 1;
+
+  while (state->ban_cnt) {
+    (state->ban_cnt)--;
+    struct wfc__ban b = state->bans[state->ban_cnt];
+    WFC__STAT(state->stats.prop_cnt++);
+
+    for (int d=0; d<4; d++) {
+      int dst_cell_idx = wfc__neighbour(state, b.cell_idx, d);
+      if (dst_cell_idx == -1)
+        continue;
+
+      int *supports = &( state->supports[(size_t)dst_cell_idx * tile_cnt * 4] );
+      if (model->neighbours != NULL) {
+        size_t r = (size_t)d * tile_cnt + b.tile_idx;
+        for (int k=model->neighbour_offsets[r]; k<model->neighbour_offsets[r+1]; k++) {
+          int tile_idx = model->neighbours[k];
+          if (--supports[tile_idx*4 + d] == 0 && rv)
+            rv = wfc__ban(state, dst_cell_idx, tile_idx);
+        }
+        continue;
+      }
+
+      const uint64_t *row = model->allowed_tiles[d] + (size_t)b.tile_idx * word_cnt;
+      for (int w=0; w<word_cnt; w++) {
+        for (uint64_t bits=row[w]; bits; bits&=bits-1) {
+          int tile_idx = w * WFC__WORD_BITS + wfc__ctz(bits);
+          if (--supports[tile_idx*4 + d] == 0 && rv)
+            rv = wfc__ban(state, dst_cell_idx, tile_idx);
+        }
+      }
+    }
+  }
+
+  return rv;
+}
+
+// Reverts wfc__push_ban and the propagation of the ban
+static void wfc__unban(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  const struct wfc_model *model = state->model;
+  int tile_cnt = model->tile_cnt;
+  int word_cnt = model->tile_word_cnt;
+
+  int *supports = &( state->supports[((size_t)cell_idx * tile_cnt + tile_idx) * 4] );
+  for (int d=0; d<4; d++)
+    supports[d] -= tile_cnt;
+
+  for (int d=0; d<4; d++) {
+    int dst_cell_idx = wfc__neighbour(state, cell_idx, d);
+    if (dst_cell_idx == -1)
+      continue;
+
+    int *dst_supports = &( state->supports[(size_t)dst_cell_idx * tile_cnt * 4] );
+    if (model->neighbours != NULL) {
+      size_t r = (size_t)d * tile_cnt + tile_idx;
+      for (int k=model->neighbour_offsets[r]; k<model->neighbour_offsets[r+1]; k++)
+        dst_supports[model->neighbours[k]*4 + d]++;
+      continue;
+    }
+
+    const uint64_t *row = model->allowed_tiles[d] + (size_t)tile_idx * word_cnt;
+    for (int w=0; w<word_cnt; w++) {
+      for (uint64_t bits=row[w]; bits; bits&=bits-1)
+        dst_supports[(w * WFC__WORD_BITS + wfc__ctz(bits))*4 + d]++;
+    }
+  }
+}
+
+// Queues props from the cell to all its neighbours
+static void wfc__add_cell_props(struct wfc_state *state, int cell_idx)
+{
+  if (!wfc__is_prop_pending(state, cell_idx, WFC_UP)) wfc__add_prop_up(state, cell_idx);
+  if (!wfc__is_prop_pending(state, cell_idx, WFC_DOWN)) wfc__add_prop_down(state, cell_idx);
+  if (!wfc__is_prop_pending(state, cell_idx, WFC_LEFT)) wfc__add_prop_left(state, cell_idx);
+  if (!wfc__is_prop_pending(state, cell_idx, WFC_RIGHT)) wfc__add_prop_right(state, cell_idx);
+}
+
+// Propagates the queued props until none are left
+//
+// Return 0 on error (contradiction)
+static int wfc__propagate_props(struct wfc_state *state)
+{
+  int prop_cap = state->cell_cnt * 4;
+  while (state->prop_cnt) {
+    // Copy the prop out, propagating it can reuse its slot
+    struct wfc__prop p = state->props[state->prop_head];
+    state->prop_head = (state->prop_head + 1) % prop_cap;
+    (state->prop_cnt)--;
+    state->prop_pending[p.src_cell_idx*4 + p.direction] = 0;
+    WFC__STAT(state->stats.prop_cnt++);
+
+    if (!wfc__propagate_prop(state, &p)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Return 0 on error (contradiction)
+static int wfc__propagate(struct wfc_state *state, int cell_idx)
+{
+  if (state->propagation == WFC_PROPAGATION_SUPPORT)
+    return wfc__propagate_bans(state);
+
+  wfc__clear_props(state);
+  wfc__add_cell_props(state, cell_idx);
+  return wfc__propagate_props(state);
+}
+
+// Removes all tiles but the given one, which must be possible, from the
+// cell
+static void wfc__keep_tile(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+  int word_cnt = state->model->tile_word_cnt;
+
+  wfc__bit_clear(cell->tiles, tile_idx);
+  for (int v=0; v<word_cnt; v++) {
+    for (uint64_t removed=cell->tiles[v]; removed; removed&=removed-1) {
+      int removed_tile_idx = v * WFC__WORD_BITS + wfc__ctz(removed);
+      wfc__save_removal(state, cell_idx, removed_tile_idx);
+      wfc__account_tile(state->model, cell, removed_tile_idx, -1);
+      if (state->propagation == WFC_PROPAGATION_SUPPORT)
+        wfc__push_ban(state, cell_idx, removed_tile_idx);
+    }
+    cell->tiles[v] = 0;
+  }
+  wfc__bit_set(cell->tiles, tile_idx);
+  WFC__STAT(state->stats.ban_cnt += cell->tile_cnt - 1);
+  wfc__set_tile_cnt(state, cell_idx, 1);
+}
+
+// Return 0 on error (contradiction)
+static int wfc__collapse(struct wfc_state *state, int cell_idx)
+{
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+  if (cell->tile_cnt == 0)
+    return 0;
+
+  int word_cnt = state->model->tile_word_cnt;
+  int remaining = wfc__rng_below(&state->rng, cell->sum_freqs);
+  for (int w=0; w<word_cnt; w++) {
+    for (uint64_t bits=cell->tiles[w]; bits; bits&=bits-1) {
+      int tile_idx = w * WFC__WORD_BITS + wfc__ctz(bits);
+      int freq = state->model->tiles[tile_idx].freq;
+      if (remaining >= freq) {
+        remaining -= freq;
+        continue;
+      }
+
+      wfc__push_decision(state, cell_idx, tile_idx);
+      wfc__keep_tile(state, cell_idx, tile_idx);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Collapses the cell to the tile for good, before any decision is made,
+// and propagates it
+//
+// Return 0 on error (contradiction, or the tile is no longer possible)
+static int wfc__constrain_cell(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  if (!wfc__bit_test(state->cells[cell_idx].tiles, tile_idx))
+    return 0;
+
+  wfc__keep_tile(state, cell_idx, tile_idx);
+  return wfc__propagate(state, cell_idx);
+}
+
+// Restores the tiles removed since the trail was trail_cnt long
+static void wfc__undo(struct wfc_state *state, int trail_cnt)
+{
+  while (state->trail_cnt > trail_cnt) {
+    (state->trail_cnt)--;
+    struct wfc__change c = state->trail[state->trail_cnt];
+    struct wfc__cell *cell = &( state->cells[c.cell_idx] );
+
+    wfc__bit_set(cell->tiles, c.tile_idx);
+    wfc__account_tile(state->model, cell, c.tile_idx, 1);
+    if (state->propagation == WFC_PROPAGATION_SUPPORT)
+      wfc__unban(state, c.cell_idx, c.tile_idx);
+    wfc__set_tile_cnt(state, c.cell_idx, cell->tile_cnt + 1);
+  }
+}
+
+// Undoes the latest decision and removes the tile it picked from the cell,
+// and so on while the removal leads to a contradiction as well
+//
+// Return 0 on error (no decision left or backtrack limit reached)
+static int wfc__backtrack(struct wfc_state *state)
+{
+  while (state->decision_cnt > 0 && state->backtrack_cnt < state->max_backtrack_cnt) {
+    (state->backtrack_cnt)++;
+    (state->decision_cnt)--;
+    struct wfc__decision d = state->decisions[state->decision_cnt];
+    wfc__undo(state, d.trail_cnt);
+
+    if (state->propagation == WFC_PROPAGATION_SUPPORT) {
+      int rv = wfc__ban(state, d.cell_idx, d.tile_idx);
+      if (wfc__propagate_bans(state) && rv)
+        return 1;
+    } else {
+      if (wfc__remove_tile(state, d.cell_idx, d.tile_idx) && wfc__propagate(state, d.cell_idx))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Updates the entropy of the cells changed since the last call, and their
+// place in the heap if update_heap
+static void wfc__flush_dirty(struct wfc_state *state, int update_heap)
+{
+  for (int i=0; i<state->dirty_cnt; i++) {
+    state->cell_dirty[ state->dirty[i] ] = 0;
+    wfc__update_entropy(&( state->cells[ state->dirty[i] ] ));
+    if (update_heap)
+      wfc__heap_update(state, state->dirty[i]);
+  }
+  state->dirty_cnt = 0;
+}
+
+static int wfc__next_cell(struct wfc_state *state)
+{
+  wfc__flush_dirty(state, state->selection == WFC_SELECTION_HEAP);
+
+  if (state->selection == WFC_SELECTION_HEAP)
+    return state->heap_cnt ? state->heap[0] : -1;
+
+  int min_idx = -1;
+  double min_entropy = DBL_MAX;
+
+  for (int i=0; i<state->cell_cnt; i++) {
+    double entropy = state->cells[i].entropy + state->cells[i].noise;
+    if (state->cells[i].tile_cnt != 1 && entropy < min_entropy) {
+      min_entropy = entropy;
+      min_idx = i;
+    }
+  }
+
+  return min_idx;
+}
+
+static void wfc__init_cells(struct wfc_state *state)
+{
+  const struct wfc_model *model = state->model;
+  int word_cnt = model->tile_word_cnt;
+  int tail_bit_cnt = model->tile_cnt % WFC__WORD_BITS;
+
+  for (int i=0; i<state->cell_cnt; i++) {
+    state->cells[i].tile_cnt = model->tile_cnt;
+    state->cells[i].sum_freqs = model->sum_freqs;
+    state->cells[i].sum_freq_log_freqs = model->sum_freq_log_freqs;
+    state->cells[i].entropy = model->entropy;
+    for (int w=0; w<word_cnt; w++) {
+      state->cells[i].tiles[w] = ~(uint64_t)0;
+    }
+    if (tail_bit_cnt)
+      state->cells[i].tiles[word_cnt-1] = ((uint64_t)1 << tail_bit_cnt) - 1;
+  }
+
+  wfc__clear_props(state);
+}
+
+static void wfc__destroy_supports(struct wfc_state *state)
+{
+  free(state->supports);
+  free(state->bans);
+  state->supports = NULL;
+  state->bans = NULL;
+}
+
+// Return 0 on error
+static int wfc__create_supports(struct wfc_state *state)
+{
+  size_t cnt = (size_t)state->cell_cnt * state->model->tile_cnt;
+
+  state->supports = malloc(sizeof(*state->supports) * cnt * 4);
+  state->bans = malloc(sizeof(*state->bans) * cnt);
+  if (state->supports == NULL || state->bans == NULL) {
+    p("wfc__create_supports: error\n");
+    wfc__destroy_supports(state);
+    return 0;
+  }
+
+  return 1;
+}
+
+// Resets supports and removes tiles that no tile allows from the direction
+// of an existing neighbour. A contradiction found here is reported by
+// wfc_state_run.
+static void wfc__init_supports(struct wfc_state *state)
+{
+  const struct wfc_model *model = state->model;
+  size_t cell_supports_cnt = (size_t)model->tile_cnt * 4;
+  for (int i=0; i<state->cell_cnt; i++)
+    memcpy(&state->supports[i * cell_supports_cnt], model->initial_supports, sizeof(*state->supports) * cell_supports_cnt);
+
+  state->ban_cnt = 0;
+  for (int i=0; i<state->cell_cnt; i++) {
+    for (int j=0; j<model->tile_cnt; j++) {
+      for (int d=0; d<4; d++) {
+        // The neighbour supporting cell i in direction d lies in the
+        // opposite direction (up/down and left/right differ by the low bit)
+        if (model->initial_supports[j*4 + d] == 0 && wfc__neighbour(state, i, d ^ 1) != -1) {
+          wfc__ban(state, i, j);
+          break;
+        }
+      }
+    }
+  }
+
+  wfc__propagate_bans(state);
+}
+
+static void wfc__destroy_decisions(struct wfc_state *state)
+{
+  free(state->decisions);
+  free(state->trail);
+  state->decisions = NULL;
+  state->trail = NULL;
+  state->decision_cap = 0;
+  state->trail_cap = 0;
+}
+
+// Return 0 on error
+static int wfc__create_decisions(struct wfc_state *state)
+{
+  int cap = state->cell_cnt;
+  if (state->backtrack_depth > 0 && state->backtrack_depth < cap)
+    cap = state->backtrack_depth;
+
+  if (state->decisions != NULL && state->decision_cap == cap)
+    return 1;
+
+  free(state->decisions);
+  state->decisions = malloc(sizeof(*state->decisions) * cap);
+  if (state->decisions == NULL) {
+    p("wfc__create_decisions: error\n");
+    wfc__destroy_decisions(state);
+    return 0;
+  }
+  state->decision_cap = cap;
+
+  return 1;
+}
+
+// Allows to call wfc_state_run again, generation is reproducible for
+// a given seed
+static void wfc__copy_cells(struct wfc__cell *dst, const struct wfc__cell *src, int cell_cnt, int word_cnt)
+{
+  memcpy(dst[0].tiles, src[0].tiles, sizeof(*dst[0].tiles) * word_cnt * cell_cnt);
+  for (int i=0; i<cell_cnt; i++) {
+    dst[i].tile_cnt = src[i].tile_cnt;
+    dst[i].sum_freqs = src[i].sum_freqs;
+    dst[i].sum_freq_log_freqs = src[i].sum_freq_log_freqs;
+    dst[i].entropy = src[i].entropy;
+  }
+}
+
+static void wfc__destroy_template(struct wfc_state *state)
+{
+  wfc__destroy_cells(state->template_cells, state->cell_cnt);
+  free(state->template_supports);
+  state->template_cells = NULL;
+  state->template_supports = NULL;
+}
+
+// Saves the freshly initialized cells and supports as the template. Without
+// memory for it every init recomputes them.
+//
+// Return 0 on error
+static int wfc__save_template(struct wfc_state *state)
+{
+  const struct wfc_model *model = state->model;
+  size_t supports_cnt = (size_t)state->cell_cnt * model->tile_cnt * 4;
+  int support = state->propagation == WFC_PROPAGATION_SUPPORT;
+
+  wfc__destroy_template(state);
+  if (!support && !state->constrained)
+    return 1;
+
+  if (!wfc__within_cap(state, wfc__cell_bytes(state->cell_cnt, model->tile_word_cnt) +
+                              (support ? sizeof(*state->template_supports) * supports_cnt : 0))) {
+    p("wfc__save_template: error (over the memory cap)\n");
+    return 0;
+  }
+
+  state->template_cells = wfc__create_cells(state->cell_cnt, model->tile_word_cnt);
+  if (support)
+    state->template_supports = malloc(sizeof(*state->template_supports) * supports_cnt);
+  if (state->template_cells == NULL || (support && state->template_supports == NULL)) {
+    p("wfc__save_template: error\n");
+    wfc__destroy_template(state);
+    return 0;
+  }
+
+  if (support)
+    memcpy(state->template_supports, state->supports, sizeof(*state->supports) * supports_cnt);
+
+  wfc__copy_cells(state->template_cells, state->cells, state->cell_cnt, model->tile_word_cnt);
+  state->template_collapsed_cell_cnt = state->collapsed_cell_cnt;
+  return 1;
+}
+
+// Return 0 if there is no template
+static int wfc__load_template(struct wfc_state *state)
+{
+  const struct wfc_model *model = state->model;
+  int support = state->propagation == WFC_PROPAGATION_SUPPORT;
+  if (state->template_cells == NULL || support != (state->template_supports != NULL))
+    return 0;
+
+  size_t supports_cnt = (size_t)state->cell_cnt * model->tile_cnt * 4;
+  wfc__copy_cells(state->cells, state->template_cells, state->cell_cnt, model->tile_word_cnt);
+  if (support)
+    memcpy(state->supports, state->template_supports, sizeof(*state->supports) * supports_cnt);
+  state->ban_cnt = 0;
+  state->collapsed_cell_cnt = state->template_collapsed_cell_cnt;
+  wfc__clear_props(state);
+
+  // Entropies come from the template as well
+  for (int i=0; i<state->dirty_cnt; i++)
+    state->cell_dirty[ state->dirty[i] ] = 0;
+  state->dirty_cnt = 0;
+
+  return 1;
+}
+
+void wfc_state_init(struct wfc_state *state, unsigned int seed)
+{
+  state->seed = seed;
+  wfc__rng_seed(&state->rng, seed);
+  WFC__STAT(memset(&state->stats, 0, sizeof(state->stats)));
+  state->collapsed_cell_cnt = 0;
+  state->started = 0;
+  state->start_cell_idx = -1;
+  state->backtrack_cnt = 0;
+  state->decision_cnt = 0;
+  state->trail_cnt = 0;
+  if (state->max_backtrack_cnt <= 0)
+    wfc__destroy_decisions(state);
+  else if (!wfc__create_decisions(state))
+    state->max_backtrack_cnt = 0;
+
+  if (state->propagation == WFC_PROPAGATION_SUPPORT && state->supports == NULL &&
+      (!wfc__within_cap(state, wfc__support_bytes(state->cell_cnt, state->model->tile_cnt)) ||
+       !wfc__create_supports(state)))
+    state->propagation = WFC_PROPAGATION_SCAN;
+
+  if (!wfc__load_template(state)) {
+    state->constrained = 0;
+    wfc__init_cells(state);
+    if (state->propagation == WFC_PROPAGATION_SUPPORT)
+      wfc__init_supports(state);
+    wfc__flush_dirty(state, 0);
+    wfc__save_template(state);
+  }
+
+  for (int i=0; i<state->cell_cnt; i++) {
+    state->cells[i].noise = wfc__rng_double(&state->rng) / 100000.0;
+    state->cell_tiles[i] = state->cells[i].tile_cnt == 1 ? wfc__first_bit(state->cells[i].tiles, state->model->tile_word_cnt) : -1;
+  }
+
+  if (state->selection == WFC_SELECTION_HEAP)
+    wfc__init_heap(state);
+}
+
+// Removes the tiles not in keep from the cell, and queues the removals to
+// be propagated by wfc__propagate_queued
+//
+// Return 0 on error (contradiction)
+static int wfc__restrict_cell(struct wfc_state *state, int cell_idx, const uint64_t *keep)
+{
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+  int support = state->propagation == WFC_PROPAGATION_SUPPORT;
+  int removed_cnt = 0;
+
+  for (int w=0; w<state->model->tile_word_cnt; w++) {
+    for (uint64_t bits=cell->tiles[w] & ~keep[w]; bits; bits&=bits-1) {
+      int tile_idx = w * WFC__WORD_BITS + wfc__ctz(bits);
+      removed_cnt++;
+      if (!(support ? wfc__ban(state, cell_idx, tile_idx) : wfc__remove_tile(state, cell_idx, tile_idx)))
+        return 0;
+    }
+  }
+
+  if (removed_cnt && !support)
+    wfc__add_cell_props(state, cell_idx);
+  return 1;
+}
+
+// Propagates the removals queued by wfc__restrict_cell
+//
+// Return 0 on error (contradiction)
+static int wfc__propagate_queued(struct wfc_state *state)
+{
+  if (state->propagation == WFC_PROPAGATION_SUPPORT)
+    return wfc__propagate_bans(state);
+  return wfc__propagate_props(state);
+}
+
+static int wfc__cmp_constraints(const void *a, const void *b)
+{
+  const int *x = a;
+  const int *y = b;
+  return x[0] != y[0] ? x[0] - y[0] : x[1] - y[1];
+}
+
+// Restricts cells to tiles, cells[i] may have tiles[i]. A cell listed
+// several times keeps all of its listed tiles. The constraints are
+// propagated together, from all the constrained cells at once. Call after
+// wfc_state_init, later inits start from the constrained cells without
+// propagating again, until wfc_state_clear_constraints or a change of
+// propagation.
+//
+// Return 0 on error (out of memory, or contradiction, after which the
+// state needs wfc_state_init)
+int wfc_state_constrain(struct wfc_state *state, int n, const int *cells, const int *tiles)
+{
+  const struct wfc_model *model = state->model;
+  int word_cnt = model->tile_word_cnt;
+  int rv = 1;
+
+  // (cell, tile) pairs sorted by cell
+  int *pairs = malloc(sizeof(*pairs) * 2 * (n > 0 ? n : 1));
+  if (pairs == NULL) {
+    p("wfc_state_constrain: error\n");
+    return 0;
+  }
+  for (int i=0; i<n; i++) {
+    if (cells[i] < 0 || cells[i] >= state->cell_cnt || tiles[i] < 0 || tiles[i] >= model->tile_cnt) {
+      p("wfc_state_constrain: error\n");
+      free(pairs);
+      return 0;
+    }
+    pairs[2*i] = cells[i];
+    pairs[2*i+1] = tiles[i];
+  }
+  qsort(pairs, n, sizeof(*pairs) * 2, wfc__cmp_constraints);
+
+  // Each cell is restricted once and queues its props once
+  wfc__clear_props(state);
+  uint64_t *keep = state->support;
+  for (int i=0; i<n && rv; ) {
+    int cell_idx = pairs[2*i];
+    memset(keep, 0, sizeof(*keep) * word_cnt);
+    for (; i<n && pairs[2*i] == cell_idx; i++)
+      wfc__bit_set(keep, pairs[2*i+1]);
+    rv = wfc__restrict_cell(state, cell_idx, keep);
+  }
+  free(pairs);
+
+  if (!rv || !wfc__propagate_queued(state))
+    return 0;
+
+  wfc__flush_dirty(state, state->selection == WFC_SELECTION_HEAP);
+  for (int i=0; i<state->cell_cnt; i++)
+    state->cell_tiles[i] = state->cells[i].tile_cnt == 1 ? wfc__first_bit(state->cells[i].tiles, word_cnt) : -1;
+
+  state->constrained = 1;
+  if (!wfc__save_template(state)) {
+    state->constrained = 0;
+    return 0;
+  }
+  return 1;
+}
+
+// Next wfc_state_init starts again from all tiles
+void wfc_state_clear_constraints(struct wfc_state *state)
+{
+  state->constrained = 0;
+  wfc__destroy_template(state);
+}
+
+static void wfc__report_progress(struct wfc_state *state)
+{
+  if (state->progress != NULL)
+    state->progress(state->progress_user_data, state->collapsed_cell_cnt, state->cell_cnt);
+}
+
+// Stops before the collapse after deadline_ns (of wfc__now_ns), -1 for
+// none. Runs after wfc_state_init start from a random cell, the same one
+// until it is collapsed.
+//
+// Return WFC_RUN_DONE also when max_collapse_cnt is reached
+static int wfc__run(struct wfc_state *state, int max_collapse_cnt, long long deadline_ns)
+{
+  int cell_idx;
+  if (!state->started) {
+    //cell_idx = (state->output_height / 2) * state->output_width + state->output_width / 2;
+    if (state->start_cell_idx == -1)
+      state->start_cell_idx = wfc__rng_below(&state->rng, state->output_height * state->output_width);
+    cell_idx = state->start_cell_idx;
+  } else {
+    cell_idx = wfc__next_cell(state);
+    if (cell_idx == -1) {
+      wfc__report_progress(state);
+      return WFC_RUN_DONE;
+    }
+  }
+
+  while (1) {
+    wfc__report_progress(state);
+
+    if ((state->cancel != NULL && wfc__load_flag(state->cancel)) ||
+        (deadline_ns != -1 && wfc__now_ns() >= deadline_ns))
+      return WFC_RUN_STOPPED;
+
+    state->started = 1;
+    WFC__STAT(long long start_ns = wfc__now_ns());
+    WFC__STAT(state->stats.collapse_cnt++);
+    if (!wfc__collapse(state, cell_idx) || !wfc__propagate(state, cell_idx)) {
+      WFC__STAT(state->stats.contradiction_cnt++);
+      if (!wfc__backtrack(state))
+        return WFC_RUN_FAILED;
+    }
+
+    WFC__STAT(long long propagated_ns = wfc__now_ns());
+    cell_idx = wfc__next_cell(state);
+    WFC__STAT(state->stats.propagate_ns += propagated_ns - start_ns);
+    WFC__STAT(state->stats.next_cell_ns += wfc__now_ns() - propagated_ns);
+
+    if (cell_idx == -1 || state->collapsed_cell_cnt == max_collapse_cnt) {
+      break;
+    }
+  }
+
+  wfc__report_progress(state);
+
+  return WFC_RUN_DONE;
+}
+
+// max_collapse_cnt of -1 means no iteration number limit. A run stopped by
+// max_collapse_cnt or state->cancel can be resumed with another call.
+//
+// Return 0 on error (contradiction occurred or state->cancel was set)
+int wfc_state_run(struct wfc_state *state, int max_collapse_cnt)
+{
+  return wfc__run(state, max_collapse_cnt, -1) == WFC_RUN_DONE;
+}
+
+// Runs for at most time_ns nanoseconds, checked between collapses
+//
+// Return WFC_RUN_FAILED on contradiction, WFC_RUN_DONE once all cells are
+// collapsed, or WFC_RUN_STOPPED when the time is up or state->cancel was
+// set, in which case the next call goes on from there
+int wfc_state_run_for(struct wfc_state *state, long long time_ns)
+{
+  return wfc__run(state, -1, wfc__now_ns() + (time_ns > 0 ? time_ns : 0));
+}
+
+void wfc_state_set_cancel(struct wfc_state *state, const volatile int *cancel)
+{
+  state->cancel = cancel;
+}
+
+void wfc_state_set_progress(struct wfc_state *state, void (*progress)(void *user_data, int collapsed_cell_cnt, int cell_cnt), void *user_data)
+{
+  state->progress = progress;
+  state->progress_user_data = user_data;
+}
+
+void wfc_state_destroy(struct wfc_state *state)
+{
+  if (state == NULL)
+    return;
+
+  wfc__destroy_cells(state->cells, state->cell_cnt);
+  free(state->cell_tiles);
+  wfc__destroy_props(state->props);
+  free(state->prop_pending);
+  wfc__destroy_heap(state);
+  free(state->support);
+  wfc__destroy_supports(state);
+  wfc__destroy_decisions(state);
+  wfc__destroy_template(state);
+  free(state);
+}
+
+// Same as wfc_state_create, leaving the state to be initialized with
+// wfc_state_init
+//
+// Return NULL on error
+static struct wfc_state *wfc__state_create(const struct wfc_model *model, int output_width, int output_height)
+{
+  struct wfc_state *state = malloc(sizeof(*state));
+  if (state == NULL)
+    goto CLEANUP;
+
+  state->model = model;
+  state->output_width = output_width;
+  state->output_height = output_height;
+  state->cell_cnt = output_width * output_height;
+  state->cells = NULL;
+  state->cell_tiles = NULL;
+  state->props = NULL;
+  state->prop_pending = NULL;
+  state->prop_cnt = 0;
+  state->prop_head = 0;
+  state->support = NULL;
+  state->propagation = WFC_PROPAGATION_SCAN;
+  state->selection = WFC_SELECTION_HEAP;
+  state->heap = NULL;
+  state->cell_dirty = NULL;
+  state->dirty_cnt = 0;
+  state->supports = NULL;
+  state->bans = NULL;
+  state->ban_cnt = 0;
+  state->cancel = NULL;
+  state->started = 0;
+  state->start_cell_idx = -1;
+  state->progress = NULL;
+  state->progress_user_data = NULL;
+  state->max_backtrack_cnt = 0;
+  state->backtrack_depth = 0;
+  state->decisions = NULL;
+  state->decision_cnt = 0;
+  state->decision_cap = 0;
+  state->trail = NULL;
+  state->trail_cnt = 0;
+  state->trail_cap = 0;
+  state->template_cells = NULL;
+  state->template_supports = NULL;
+  state->template_collapsed_cell_cnt = 0;
+  state->constrained = 0;
+
+  if (!wfc__within_cap(state, 0))
+    goto CLEANUP;
+
+  state->support = malloc(sizeof(*state->support) * model->tile_word_cnt * 2);
+  if (state->support == NULL)
+    goto CLEANUP;
+
+  state->cells = wfc__create_cells(state->cell_cnt, model->tile_word_cnt);
+  if (state->cells == NULL)
+    goto CLEANUP;
+
+  state->cell_tiles = malloc(sizeof(*state->cell_tiles) * state->cell_cnt);
+  if (state->cell_tiles == NULL)
+    goto CLEANUP;
+
+  state->props = wfc__create_props(state->cell_cnt);
+  if (state->props == NULL)
+    goto CLEANUP;
+
+  state->prop_pending = calloc((size_t)state->cell_cnt * 4, sizeof(*state->prop_pending));
+  if (state->prop_pending == NULL)
+    goto CLEANUP;
+
+  if (!wfc__create_heap(state))
+    goto CLEANUP;
+
+  return state;
+
+ CLEANUP:
+  p("wfc_state_create: error\n");
+  wfc_state_destroy(state);
+  return NULL;
+}
+
+// The model must outlive the state
+//
+// Return NULL on error
+struct wfc_state *wfc_state_create(const struct wfc_model *model, int output_width, int output_height)
+{
+  struct wfc_state *state = wfc__state_create(model, output_width, output_height);
+  if (state != NULL)
+    wfc_state_init(state, (unsigned int) time(NULL));
+  return state;
+}
+
+void wfc_model_destroy(struct wfc_model *model)
+{
+  if (model == NULL)
+    return;
+
+  free(model->tiles);
+  free(model->tile_pixels);
+  wfc__destroy_allowed_tiles(model->allowed_tiles);
+  wfc__destroy_neighbours(model);
+  free(model->initial_supports);
+  free(model->freq_log_freqs);
+  free(model);
+}
+
+// Computes the model's frequency sums, entropy and initial supports from
+// its tiles and rules
+//
+// Return 0 on error
+static int wfc__init_model(struct wfc_model *model)
+{
+  model->freq_log_freqs = malloc(sizeof(*model->freq_log_freqs) * model->tile_cnt);
+  model->initial_supports = calloc((size_t)model->tile_cnt * 4, sizeof(*model->initial_supports));
+  if (model->freq_log_freqs == NULL || model->initial_supports == NULL) {
+    p("wfc__init_model: error\n");
+    return 0;
+  }
+
+  model->sum_freqs = 0;
+  model->sum_freq_log_freqs = 0.0;
+  for (int i=0; i<model->tile_cnt; i++) {
+    int freq = model->tiles[i].freq;
+    model->freq_log_freqs[i] = freq * log(freq);
+    model->sum_freqs += freq;
+    model->sum_freq_log_freqs += model->freq_log_freqs[i];
+  }
+  model->entropy = log(model->sum_freqs) - model->sum_freq_log_freqs / model->sum_freqs;
+
+  if (model->neighbours != NULL) {
+    for (size_t r=0; r<(size_t)4 * model->tile_cnt; r++) {
+      int d = r / model->tile_cnt;
+      for (int k=model->neighbour_offsets[r]; k<model->neighbour_offsets[r+1]; k++)
+        model->initial_supports[model->neighbours[k]*4 + d]++;
+    }
+    return 1;
+  }
+
+  int word_cnt = model->tile_word_cnt;
+  for (int d=0; d<4; d++) {
+    for (int i=0; i<model->tile_cnt; i++) {
+      const uint64_t *row = model->allowed_tiles[d] + (size_t)i * word_cnt;
+      for (int w=0; w<word_cnt; w++) {
+        for (uint64_t bits=row[w]; bits; bits&=bits-1)
+          model->initial_supports[(w * WFC__WORD_BITS + wfc__ctz(bits))*4 + d]++;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// Model file, all in native byte order and padded to 8 bytes:
+//
+//   struct wfc__model_header
+//   allowed_tiles rows       4 * tile_cnt * tile_word_cnt uint64_t, or
+//   neighbour_offsets        4 * tile_cnt + 1 int32_t and
+//   neighbours               neighbour_cnt int32_t
+//   frequencies              tile_cnt int32_t
+//   tile pixels              tile_cnt * tile_width*tile_height*component_cnt bytes
+//
+// Sections are aligned so the file can be read, or mapped, in bulk. It is
+// a cache rather than an exchange format, a file from another version or
+// byte order fails to load.
+
+#define WFC__MODEL_MAGIC "WFCM"
+#define WFC__MODEL_VERSION 2
+
+struct wfc__model_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t key;
+  int32_t method;
+  int32_t tile_width;
+  int32_t tile_height;
+  int32_t component_cnt;
+  int32_t expand_input;
+  int32_t xflip_tiles;
+  int32_t yflip_tiles;
+  int32_t rotate_tiles;
+  int32_t tile_cnt;
+  int32_t tile_word_cnt;
+  int32_t neighbour_cnt;       // -1 for allowed_tiles rows
+};
+
+static size_t wfc__pad8(size_t size)
+{
+  return (size + 7) & ~(size_t)7;
+}
+
+static int wfc__write_padded(FILE *f, const void *data, size_t size)
+{
+  static const unsigned char zeros[8] = {0};
+  size_t pad = wfc__pad8(size) - size;
+  return fwrite(data, 1, size, f) == size && fwrite(zeros, 1, pad, f) == pad;
+}
+
+static int wfc__read_padded(FILE *f, void *data, size_t size)
+{
+  unsigned char pad[8];
+  size_t pad_size = wfc__pad8(size) - size;
+  return fread(data, 1, size, f) == size && fread(pad, 1, pad_size, f) == pad_size;
+}
+
+// Return 0 on error
+int wfc_model_save(const struct wfc_model *model, unsigned long long key, const char *filename)
+{
+  FILE *f = NULL;
+  int32_t *freqs = malloc(sizeof(*freqs) * model->tile_cnt);
+  if (freqs == NULL)
+    goto CLEANUP;
+
+  for (int i=0; i<model->tile_cnt; i++)
+    freqs[i] = model->tiles[i].freq;
+
+  struct wfc__model_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, WFC__MODEL_MAGIC, sizeof(header.magic));
+  header.version = WFC__MODEL_VERSION;
+  header.key = key;
+  header.method = model->method;
+  header.tile_width = model->tile_width;
+  header.tile_height = model->tile_height;
+  header.component_cnt = model->component_cnt;
+  header.expand_input = model->expand_input;
+  header.xflip_tiles = model->xflip_tiles;
+  header.yflip_tiles = model->yflip_tiles;
+  header.rotate_tiles = model->rotate_tiles;
+  header.tile_cnt = model->tile_cnt;
+  header.tile_word_cnt = model->tile_word_cnt;
+  header.neighbour_cnt = model->neighbours != NULL ? model->neighbour_offsets[4 * model->tile_cnt] : -1;
+
+  f = fopen(filename, "wb");
+  if (f == NULL)
+    goto CLEANUP;
+
+  size_t tile_size = (size_t)model->tile_width * model->tile_height * model->component_cnt;
+  size_t rows_size = sizeof(*model->allowed_tiles[0]) * 4 * model->tile_cnt * model->tile_word_cnt;
+  size_t offsets_size = sizeof(*model->neighbour_offsets) * (4 * (size_t)model->tile_cnt + 1);
+  if (!wfc__write_padded(f, &header, sizeof(header)))
+    goto CLEANUP;
+  if (model->neighbours != NULL) {
+    if (!wfc__write_padded(f, model->neighbour_offsets, offsets_size) ||
+        !wfc__write_padded(f, model->neighbours, sizeof(*model->neighbours) * header.neighbour_cnt))
+      goto CLEANUP;
+  } else if (!wfc__write_padded(f, model->allowed_tiles[0], rows_size)) {
+    goto CLEANUP;
+  }
+  if (!wfc__write_padded(f, freqs, sizeof(*freqs) * model->tile_cnt) ||
+      !wfc__write_padded(f, model->tile_pixels, tile_size * model->tile_cnt))
+    goto CLEANUP;
+
+  free(freqs);
+  return fclose(f) == 0;
+
+ CLEANUP:
+  p("wfc_model_save: error\n");
+  if (f != NULL) {
+    fclose(f);
+    remove(filename);
+  }
+  free(freqs);
+  return 0;
+}
+
+// Return NULL on error, or if the file is missing or holds another key
+struct wfc_model *wfc_model_load(const char *filename, unsigned long long key)
+{
+  struct wfc_model *model = NULL;
+  int32_t *freqs = NULL;
+
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+
+  struct wfc__model_header header;
+  if (!wfc__read_padded(f, &header, sizeof(header)) ||
+      memcmp(header.magic, WFC__MODEL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != WFC__MODEL_VERSION ||
+      header.key != key) {
+    fclose(f);
+    return NULL;
+  }
+
+  if (header.tile_cnt <= 0 || header.tile_width <= 0 || header.tile_height <= 0 ||
+      header.component_cnt <= 0 || header.tile_word_cnt != wfc__word_cnt(header.tile_cnt))
+    goto CLEANUP;
+
+  model = malloc(sizeof(*model));
+  if (model == NULL)
+    goto CLEANUP;
+
+  WFC__STAT(memset(&model->stats, 0, sizeof(model->stats)));
+  model->method = header.method;
+  model->tile_width = header.tile_width;
+  model->tile_height = header.tile_height;
+  model->component_cnt = header.component_cnt;
+  model->expand_input = header.expand_input;
+  model->xflip_tiles = header.xflip_tiles;
+  model->yflip_tiles = header.yflip_tiles;
+  model->rotate_tiles = header.rotate_tiles;
+  model->memory_cap = 0;
+  model->tile_cnt = header.tile_cnt;
+  model->tile_word_cnt = header.tile_word_cnt;
+  model->allowed_tiles[0] = NULL;
+  model->neighbours = NULL;
+  model->neighbour_offsets = NULL;
+  model->initial_supports = NULL;
+  model->freq_log_freqs = NULL;
+
+  size_t tile_size = (size_t)model->tile_width * model->tile_height * model->component_cnt;
+  size_t rows_size = sizeof(*model->allowed_tiles[0]) * 4 * model->tile_cnt * model->tile_word_cnt;
+  size_t offsets_size = sizeof(*model->neighbour_offsets) * (4 * (size_t)model->tile_cnt + 1);
+  model->tiles = malloc(sizeof(*model->tiles) * model->tile_cnt);
+  model->tile_pixels = malloc(tile_size * model->tile_cnt);
+  freqs = malloc(sizeof(*freqs) * model->tile_cnt);
+  if (model->tiles == NULL || model->tile_pixels == NULL || freqs == NULL)
+    goto CLEANUP;
+
+  if (header.neighbour_cnt >= 0) {
+    if (!wfc__create_neighbours(model, header.neighbour_cnt) ||
+        !wfc__read_padded(f, model->neighbour_offsets, offsets_size) ||
+        !wfc__read_padded(f, model->neighbours, sizeof(*model->neighbours) * header.neighbour_cnt))
+      goto CLEANUP;
+
+    // Checked once here instead of on every use
+    int row_cnt = 4 * model->tile_cnt;
+    if (model->neighbour_offsets[0] != 0 || model->neighbour_offsets[row_cnt] != header.neighbour_cnt)
+      goto CLEANUP;
+    for (int r=0; r<row_cnt; r++) {
+      if (model->neighbour_offsets[r+1] < model->neighbour_offsets[r])
+        goto CLEANUP;
+    }
+    for (int k=0; k<header.neighbour_cnt; k++) {
+      if (model->neighbours[k] < 0 || model->neighbours[k] >= model->tile_cnt)
+        goto CLEANUP;
+    }
+  } else {
+    if (!wfc__create_allowed_tiles(model->allowed_tiles, model->tile_cnt, model->tile_word_cnt) ||
+        !wfc__read_padded(f, model->allowed_tiles[0], rows_size))
+      goto CLEANUP;
+
+    // Bits past tile_cnt would be walked as tiles, checked as the lists are
+    int tail_bit_cnt = model->tile_cnt % WFC__WORD_BITS;
+    if (tail_bit_cnt) {
+      uint64_t tail_mask = ~(((uint64_t)1 << tail_bit_cnt) - 1);
+      for (int r=0; r<4 * model->tile_cnt; r++) {
+        if (model->allowed_tiles[0][(size_t)r * model->tile_word_cnt + model->tile_word_cnt - 1] & tail_mask)
+          goto CLEANUP;
+      }
+    }
+  }
+
+  if (!wfc__read_padded(f, freqs, sizeof(*freqs) * model->tile_cnt) ||
+      !wfc__read_padded(f, model->tile_pixels, tile_size * model->tile_cnt))
+    goto CLEANUP;
+
+  for (int i=0; i<model->tile_cnt; i++) {
+    if (freqs[i] <= 0)
+      goto CLEANUP;
+    model->tiles[i].freq = freqs[i];
+  }
+
+  if (!wfc__init_model(model))
+    goto CLEANUP;
+
+  free(freqs);
+  fclose(f);
+  return model;
+
+ CLEANUP:
+  p("wfc_model_load: error\n");
+  wfc_model_destroy(model);
+  free(freqs);
+  fclose(f);
+  return NULL;
+}
+
+// Allows to call wfc_run again
+void wfc_init(struct wfc *wfc)
+{
+  wfc_state_init(wfc->state, (unsigned int) time(NULL)); // 1641743677
+}
+
+// Allows to call wfc_run again, generation is reproducible for a given seed
+void wfc_init_seed(struct wfc *wfc, unsigned int seed)
+{
+  wfc_state_init(wfc->state, seed);
+}
+
+// Return 0 on error, see wfc_state_constrain
+int wfc_constrain(struct wfc *wfc, int n, const int *cells, const int *tiles)
+{
+  return wfc_state_constrain(wfc->state, n, cells, tiles);
+}
+
+void wfc_clear_constraints(struct wfc *wfc)
+{
+  wfc_state_clear_constraints(wfc->state);
+}
+
+// max_collapse_cnt of -1 means no iteration number limit
+//
+// Return 0 on error (contradiction occurred)
+int wfc_run(struct wfc *wfc, int max_collapse_cnt)
+{
+  return wfc_state_run(wfc->state, max_collapse_cnt);
+}
+
+// Return one of enum wfc_run_result, see wfc_state_run_for
+int wfc_run_for(struct wfc *wfc, long long time_ns)
+{
+  return wfc_state_run_for(wfc->state, time_ns);
+}
+
+void wfc_set_cancel(struct wfc *wfc, const volatile int *cancel)
+{
+  wfc_state_set_cancel(wfc->state, cancel);
+}
+
+void wfc_set_progress(struct wfc *wfc, void (*progress)(void *user_data, int collapsed_cell_cnt, int cell_cnt), void *user_data)
+{
+  wfc_state_set_progress(wfc->state, progress, user_data);
+}
+
+void wfc_destroy(struct wfc *wfc)
+{
+  if (wfc == NULL)
+    return;
+
+  wfc_state_destroy(wfc->state);
+  wfc_model_destroy(wfc->model);
+  free(wfc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// WFC: Batch and race (Method-independent)
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs the worker on thread_cnt threads, the calling thread being one of
+// them. Without WFC_USE_PTHREADS, or if no thread can be started, the
+// calling thread is the only worker.
+static void wfc__run_workers(void *(*worker)(void *), void *arg, int thread_cnt)
+{
+#ifdef WFC_USE_PTHREADS
+  pthread_t *threads = NULL;
+  int started_cnt = 0;
+  if (thread_cnt > 1)
+    threads = malloc(sizeof(*threads) * (thread_cnt-1));
+
+  if (threads != NULL) {
+    while (started_cnt < thread_cnt-1 && pthread_create(&threads[started_cnt], NULL, worker, arg) == 0)
+      started_cnt++;
+  }
+  worker(arg);
+
+  for (int i=0; i<started_cnt; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+#else
+  (void)thread_cnt;
+  worker(arg);
+#endif
+}
+
+#ifdef WFC_USE_PTHREADS
+typedef pthread_mutex_t wfc__mutex;
+#else
+typedef int wfc__mutex;        // Unused without threads
+#endif
+
+static void wfc__mutex_init(wfc__mutex *mutex)
+{
+#ifdef WFC_USE_PTHREADS
+  pthread_mutex_init(mutex, NULL);
+#else
+  *mutex = 0;
+#endif
+}
+
+static void wfc__mutex_destroy(wfc__mutex *mutex)
+{
+#ifdef WFC_USE_PTHREADS
+  pthread_mutex_destroy(mutex);
+#else
+  (void)mutex;
+#endif
+}
+
+static void wfc__lock(wfc__mutex *mutex)
+{
+#ifdef WFC_USE_PTHREADS
+  pthread_mutex_lock(mutex);
+#else
+  (void)mutex;
+#endif
+}
+
+static void wfc__unlock(wfc__mutex *mutex)
+{
+#ifdef WFC_USE_PTHREADS
+  pthread_mutex_unlock(mutex);
+#else
+  (void)mutex;
+#endif
+}
+
+// Jobs shared by batch workers
+struct wfc__batch {
+  const struct wfc_model *model;
+  int output_width;
+  int output_height;
+  int job_cnt;
+  const unsigned int *seeds;
+  struct wfc_image **outputs;
+  int next_job;                // Index of the next job to take
+  int success_cnt;
+  wfc__mutex mutex;
+};
+
+// Return index of the next job and record the result of the previous one,
+// -1 if there are no jobs left
+static int wfc__batch_next_job(struct wfc__batch *batch, int prev_success)
+{
+  wfc__lock(&batch->mutex);
+  batch->success_cnt += prev_success;
+  int job = batch->next_job < batch->job_cnt ? batch->next_job++ : -1;
+  wfc__unlock(&batch->mutex);
+  return job;
+}
+
+// Each worker reuses a single state for all the jobs it takes
+static void *wfc__batch_worker(void *arg)
+{
+  struct wfc__batch *batch = arg;
+  struct wfc_state *state = wfc_state_create(batch->model, batch->output_width, batch->output_height);
+  if (state == NULL) {
+    p("wfc__batch_worker: error\n");
+    return NULL;
+  }
+
+  int success = 0;
+  int job;
+  while ((job = wfc__batch_next_job(batch, success)) != -1) {
+    unsigned int seed = batch->seeds ? batch->seeds[job] : (unsigned int) time(NULL) + job;
+    wfc_state_init(state, seed);
+
+    batch->outputs[job] = wfc_state_run(state, -1) ? wfc_state_output_image(state) : NULL;
+    success = batch->outputs[job] != NULL;
+  }
+
+  wfc_state_destroy(state);
+  return NULL;
+}
+
+// Generates n outputs from the model using up to thread_cnt threads.
+// outputs[i] is generated with seeds[i] (current time + i if seeds is
+// NULL), and is NULL if a contradiction occurred. Without
+// WFC_USE_PTHREADS the outputs are generated one after another.
+//
+// Return the number of successfully generated outputs
+int wfc_run_batch(const struct wfc_model *model,
+                  int output_width,
+                  int output_height,
+                  int n,
+                  const unsigned int *seeds,
+                  int thread_cnt,
+                  struct wfc_image **outputs)
+{
+  struct wfc__batch batch;
+  batch.model = model;
+  batch.output_width = output_width;
+  batch.output_height = output_height;
+  batch.job_cnt = n;
+  batch.seeds = seeds;
+  batch.outputs = outputs;
+  batch.next_job = 0;
+  batch.success_cnt = 0;
+
+  for (int i=0; i<n; i++)
+    outputs[i] = NULL;
+
+  wfc__mutex_init(&batch.mutex);
+  wfc__run_workers(wfc__batch_worker, &batch, thread_cnt < n ? thread_cnt : n);
+  wfc__mutex_destroy(&batch.mutex);
+
+  return batch.success_cnt;
+}
+
+// Attempts racing to solve the same model
+struct wfc__race {
+  const struct wfc_model *model;
+  int output_width;
+  int output_height;
+  unsigned int seed;           // Attempt i uses seed+i
+  int attempt_cnt;
+  int next_attempt;            // Index of the next attempt to start
+  volatile int done;           // Set by the first successful attempt,
+                               // cancels the other attempts
+  struct wfc_image *output;    // Output of the first successful attempt
+  unsigned int winning_seed;
+  wfc__mutex mutex;
+};
+
+// Return index of the next attempt, -1 if all are started or one succeeded
+static int wfc__race_next_attempt(struct wfc__race *race)
+{
+  wfc__lock(&race->mutex);
+  int attempt = !race->done && race->next_attempt < race->attempt_cnt ? race->next_attempt++ : -1;
+  wfc__unlock(&race->mutex);
+  return attempt;
+}
+
+// Each worker reuses a single state for all the attempts it takes
+static void *wfc__race_worker(void *arg)
+{
+  struct wfc__race *race = arg;
+  struct wfc_state *state = wfc_state_create(race->model, race->output_width, race->output_height);
+  if (state == NULL) {
+    p("wfc__race_worker: error\n");
+    return NULL;
+  }
+  state->cancel = &race->done;
+
+  int attempt;
+  while ((attempt = wfc__race_next_attempt(race)) != -1) {
+    wfc_state_init(state, race->seed + attempt);
+    if (!wfc_state_run(state, -1))
+      continue;
+
+    struct wfc_image *image = wfc_state_output_image(state);
+    wfc__lock(&race->mutex);
+    if (!race->done && image != NULL) {
+      race->output = image;
+      race->winning_seed = race->seed + attempt;
+      wfc__store_flag(&race->done, 1);
+      image = NULL;
+    }
+    wfc__unlock(&race->mutex);
+    wfc_img_destroy(image);
+  }
+
+  wfc_state_destroy(state);
+  return NULL;
+}
+
+// Runs up to attempt_cnt attempts on thread_cnt threads, attempt i seeded
+// with seed+i. The first attempt to fully collapse cancels the others.
+// winning_seed, if not NULL, is set to the seed of that attempt. Without
+// WFC_USE_PTHREADS the attempts run one after another.
+//
+// Return NULL if all attempts ended with a contradiction
+struct wfc_image *wfc_run_race(const struct wfc_model *model,
+                               int output_width,
+                               int output_height,
+                               unsigned int seed,
+                               int attempt_cnt,
+                               int thread_cnt,
+                               unsigned int *winning_seed)
+{
+  struct wfc__race race;
+  race.model = model;
+  race.output_width = output_width;
+  race.output_height = output_height;
+  race.seed = seed;
+  race.attempt_cnt = attempt_cnt;
+  race.next_attempt = 0;
+  race.done = 0;
+  race.output = NULL;
+  race.winning_seed = 0;
+
+  wfc__mutex_init(&race.mutex);
+  wfc__run_workers(wfc__race_worker, &race, thread_cnt < attempt_cnt ? thread_cnt : attempt_cnt);
+  wfc__mutex_destroy(&race.mutex);
+
+  if (winning_seed != NULL)
+    *winning_seed = race.winning_seed;
+
+  return race.output;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// WFC: Chunked generation (Method-independent)
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Chunks are solved one at a time in a state WFC__CHUNK_RIM cells larger
+// on the top and left. That rim holds the bottom rows of the chunks above
+// and the right columns of the chunk on the left, fixed to their tiles, so
+// the chunk's edges follow the rules with its finished neighbours. The
+// state is also WFC__CHUNK_MARGIN cells larger on the bottom and right.
+// Those cells are solved and thrown away, they only make sure the kept
+// edges can be continued. The top rim goes on over the margin with the
+// chunk above-right, so neighbouring chunks overlap over the rim and
+// rarely meet seams they can't satisfy.
+#define WFC__CHUNK_RIM 3
+#define WFC__CHUNK_MARGIN 8
+
+struct wfc__chunks {
+  struct wfc_state *state;
+  int chunk_width;
+  int chunk_height;
+  int world_width;             // chunk_cnt_x * chunk_width
+  int rim;                     // WFC__CHUNK_RIM, or less for small chunks
+  int *bottom_rows;            // Bottom rows of the previous row of chunks,
+                               // rim rows of world_width
+  int *next_bottom_rows;       // Same for the current row of chunks
+  int *right_columns;          // Right columns of the chunk on the left,
+                               // chunk_height rows of rim
+  int *tiles;                  // Tiles of the finished chunk
+  struct wfc_image *image;     // Pixels of the finished chunk
+};
+
+// Fixes the rim cells that have a finished neighbour
+//
+// Return 0 on error (contradiction)
+static int wfc__constrain_chunk_rim(struct wfc__chunks *chunks, int chunk_x, int chunk_y)
+{
+  struct wfc_state *state = chunks->state;
+  int w = state->output_width;
+  int rim = chunks->rim;
+
+  if (chunk_y > 0) {
+    int world_x = chunk_x * chunks->chunk_width - rim;
+    for (int y=0; y<rim; y++) {
+      for (int x=0; x<w; x++) {
+        if (world_x + x < 0 || world_x + x >= chunks->world_width)
+          continue;
+        int tile_idx = chunks->bottom_rows[y * chunks->world_width + world_x + x];
+        if (!wfc__constrain_cell(state, y * w + x, tile_idx))
+          return 0;
+      }
+    }
+  }
+
+  if (chunk_x > 0) {
+    for (int y=0; y<chunks->chunk_height; y++) {
+      for (int x=0; x<rim; x++) {
+        int tile_idx = chunks->right_columns[y * rim + x];
+        if (!wfc__constrain_cell(state, (rim + y) * w + x, tile_idx))
+          return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// Copies the collapsed chunk out of the state and keeps its edges for the
+// chunks to the right and below
+static void wfc__save_chunk(struct wfc__chunks *chunks, int chunk_x)
+{
+  const struct wfc_model *model = chunks->state->model;
+  const int *cell_tiles = chunks->state->cell_tiles;
+  int w = chunks->state->output_width;
+  int cw = chunks->chunk_width;
+  int ch = chunks->chunk_height;
+  int rim = chunks->rim;
+  size_t tile_size = (size_t)model->tile_width * model->tile_height * model->component_cnt;
+
+  for (int y=0; y<ch; y++) {
+    for (int x=0; x<cw; x++) {
+      int tile_idx = cell_tiles[(rim + y) * w + rim + x];
+      chunks->tiles[y * cw + x] = tile_idx;
+      memcpy(&chunks->image->data[(y * cw + x) * model->component_cnt],
+             &model->tile_pixels[tile_idx * tile_size],
+             model->component_cnt);
+    }
+  }
+
+  for (int y=0; y<ch; y++) {
+    memcpy(&chunks->right_columns[y * rim], &chunks->tiles[y * cw + cw - rim],
+           sizeof(*chunks->right_columns) * rim);
+  }
+  for (int y=0; y<rim; y++) {
+    memcpy(&chunks->next_bottom_rows[y * chunks->world_width + chunk_x * cw],
+           &chunks->tiles[(ch - rim + y) * cw],
+           sizeof(*chunks->next_bottom_rows) * cw);
+  }
+}
+
+// Generates chunk_cnt_x chunks per row, row after row, and passes each
+// finished chunk to the callback. Memory doesn't grow with the number of
+// rows, only the bottom rows of the previous row of chunks are kept. Each
+// chunk gets attempt_cnt seeds before giving up. Seams can rarely be
+// impossible to meet, then start over with another seed.
+//
+// Return 0 on error (out of memory, impossible seams, or a chunk failed
+// all attempts)
+int wfc_run_chunked(const struct wfc_model *model,
+                    int chunk_width,
+                    int chunk_height,
+                    int chunk_cnt_x,
+                    int chunk_cnt_y,
+                    unsigned int seed,
+                    int attempt_cnt,
+                    int (*callback)(void *user_data, int chunk_x, int chunk_y, const struct wfc_image *image, const int *tiles),
+                    void *user_data)
+{
+  int rv = 0;
+  struct wfc__chunks chunks;
+  chunks.chunk_width = chunk_width;
+  chunks.chunk_height = chunk_height;
+  chunks.world_width = chunk_cnt_x * chunk_width;
+  chunks.rim = WFC__CHUNK_RIM;
+  if (chunks.rim > chunk_width)
+    chunks.rim = chunk_width;
+  if (chunks.rim > chunk_height)
+    chunks.rim = chunk_height;
+  chunks.state = wfc_state_create(model,
+                                  chunks.rim + chunk_width + WFC__CHUNK_MARGIN,
+                                  chunks.rim + chunk_height + WFC__CHUNK_MARGIN);
+  chunks.bottom_rows = malloc(sizeof(*chunks.bottom_rows) * chunks.rim * chunks.world_width);
+  chunks.next_bottom_rows = malloc(sizeof(*chunks.next_bottom_rows) * chunks.rim * chunks.world_width);
+  chunks.right_columns = malloc(sizeof(*chunks.right_columns) * chunk_height * chunks.rim);
+  chunks.tiles = malloc(sizeof(*chunks.tiles) * chunk_width * chunk_height);
+  chunks.image = wfc_img_create(chunk_width, chunk_height, model->component_cnt);
+  if (chunks.state == NULL || chunks.bottom_rows == NULL || chunks.next_bottom_rows == NULL ||
+      chunks.right_columns == NULL || chunks.tiles == NULL || chunks.image == NULL) {
+    p("wfc_run_chunked: error\n");
+    goto CLEANUP;
+  }
+
+  for (int chunk_y=0; chunk_cnt_y < 0 || chunk_y < chunk_cnt_y; chunk_y++) {
+    for (int chunk_x=0; chunk_x<chunk_cnt_x; chunk_x++) {
+      unsigned int chunk_seed = seed + (unsigned int)(chunk_y * chunk_cnt_x + chunk_x) * attempt_cnt;
+      int collapsed = 0;
+      for (int i=0; i<attempt_cnt && !collapsed; i++) {
+        wfc_state_init(chunks.state, chunk_seed + i);
+        // Doesn't depend on the seed, no use trying again
+        if (!wfc__constrain_chunk_rim(&chunks, chunk_x, chunk_y))
+          goto CLEANUP;
+        collapsed = wfc_state_run(chunks.state, -1);
+      }
+      if (!collapsed)
+        goto CLEANUP;
+
+      wfc__save_chunk(&chunks, chunk_x);
+      if (!callback(user_data, chunk_x, chunk_y, chunks.image, chunks.tiles)) {
+        rv = 1;
+        goto CLEANUP;
+      }
+    }
+
+    int *bottom_rows = chunks.bottom_rows;
+    chunks.bottom_rows = chunks.next_bottom_rows;
+    chunks.next_bottom_rows = bottom_rows;
+  }
+  rv = 1;
+
+ CLEANUP:
+  wfc_state_destroy(chunks.state);
+  free(chunks.bottom_rows);
+  free(chunks.next_bottom_rows);
+  free(chunks.right_columns);
+  free(chunks.tiles);
+  wfc_img_destroy(chunks.image);
+  return rv;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// WFC: Parallel generation (Method-independent)
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// The output is cut into an odd number of horizontal stripes. The even
+// stripes are solved first, in parallel, each with WFC__CHUNK_MARGIN rows
+// thrown away above and below so its edges can be continued. Then the odd
+// stripes are solved in parallel between them, with WFC__CHUNK_RIM rows of
+// each neighbour fixed as in chunked generation.
+struct wfc__stripes {
+  const struct wfc_model *model;
+  int output_width;
+  int output_height;
+  int stripe_height;           // Of all stripes but the last one
+  int stripe_cnt;
+  unsigned int seed;
+  int attempt_cnt;             // Seeds tried per stripe
+  int *tiles;                  // Tiles of the whole output
+  int next_stripe;             // Of the phase, even or odd
+  volatile int failed;         // Set by the first stripe that fails,
+                               // cancels the other stripes
+  wfc__mutex mutex;
+};
+
+// Return index of the next stripe, -1 if all are taken or one failed
+static int wfc__stripes_next(struct wfc__stripes *stripes)
 {
-  if (src_cell_idx - wfc->output_width >= 0) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx - wfc->output_width, WFC_UP);
+  wfc__lock(&stripes->mutex);
+  int stripe = -1;
+  if (!stripes->failed && stripes->next_stripe < stripes->stripe_cnt) {
+    stripe = stripes->next_stripe;
+    stripes->next_stripe += 2;
   }
+  wfc__unlock(&stripes->mutex);
+  return stripe;
 }
 
-static void wfc__add_prop_down(struct wfc *wfc, int src_cell_idx)
+// Fixes the rim rows of an odd stripe to the even stripes around it
+//
+// Return 0 on error (contradiction)
+static int wfc__constrain_stripe_rim(struct wfc__stripes *stripes, struct wfc_state *state,
+                                     int state_y, int stripe_y, int stripe_end)
 {
-  if (src_cell_idx + wfc->output_width < wfc->cell_cnt) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx + wfc->output_width, WFC_DOWN);
+  int w = stripes->output_width;
+  for (int y=state_y; y<state_y + state->output_height; y++) {
+    if (y >= stripe_y && y < stripe_end)
+      continue;
+    for (int x=0; x<w; x++) {
+      if (!wfc__constrain_cell(state, (y - state_y) * w + x, stripes->tiles[y * w + x]))
+        return 0;
+    }
   }
+  return 1;
 }
 
-static void wfc__add_prop_left(struct wfc *wfc, int src_cell_idx)
+// Return 0 on error (out of memory, impossible rim, or all attempts failed)
+static int wfc__solve_stripe(struct wfc__stripes *stripes, int stripe)
 {
-  if (src_cell_idx % wfc->output_width != 0) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx - 1, WFC_LEFT);
+  int rv = 0;
+  int w = stripes->output_width;
+  int h = stripes->output_height;
+  int stripe_y = stripe * stripes->stripe_height;
+  int stripe_end = stripe + 1 < stripes->stripe_cnt ? stripe_y + stripes->stripe_height : h;
+  int extra = stripe % 2 == 0 ? WFC__CHUNK_MARGIN : WFC__CHUNK_RIM;
+  int state_y = stripe_y - extra > 0 ? stripe_y - extra : 0;
+  int state_end = stripe_end + extra < h ? stripe_end + extra : h;
+
+  struct wfc_state *state = wfc_state_create(stripes->model, w, state_end - state_y);
+  if (state == NULL) {
+    p("wfc__solve_stripe: error\n");
+    return 0;
+  }
+  state->cancel = &stripes->failed;
+
+  unsigned int seed = stripes->seed + (unsigned int)stripe * stripes->attempt_cnt;
+  for (int i=0; i<stripes->attempt_cnt && !rv; i++) {
+    wfc_state_init(state, seed + i);
+    // Doesn't depend on the seed, no use trying again
+    if (stripe % 2 == 1 && !wfc__constrain_stripe_rim(stripes, state, state_y, stripe_y, stripe_end))
+      break;
+    rv = wfc_state_run(state, -1);
   }
+
+  if (rv) {
+    memcpy(&stripes->tiles[stripe_y * w], &state->cell_tiles[(stripe_y - state_y) * w],
+           sizeof(*stripes->tiles) * w * (stripe_end - stripe_y));
+  }
+
+  wfc_state_destroy(state);
+  return rv;
 }
 
-static void wfc__add_prop_right(struct wfc *wfc, int src_cell_idx)
+static void *wfc__stripes_worker(void *arg)
 {
-  if (src_cell_idx % wfc->output_width != wfc->output_width - 1) {
-    wfc__add_prop(wfc, src_cell_idx, src_cell_idx + 1, WFC_RIGHT);
+  struct wfc__stripes *stripes = arg;
+  int stripe;
+  while ((stripe = wfc__stripes_next(stripes)) != -1) {
+    if (!wfc__solve_stripe(stripes, stripe))
+      wfc__store_flag(&stripes->failed, 1);
   }
+  return NULL;
 }
 
-// Does the cell enable tile in the direction?
-static int wfc__tile_enabled(struct wfc *wfc, int tile_idx, int cell_idx, enum wfc__direction d)
+// Generates one output on thread_cnt threads by solving stripes of it in
+// parallel. Stripes are at least 2*WFC__CHUNK_MARGIN rows high, so
+// outputs too low for two stripes are solved on one thread. Each stripe
+// gets attempt_cnt seeds. Stripes can rarely fail to meet, then try again
+// with another seed. Without WFC_USE_PTHREADS the stripes are solved one
+// after another.
+//
+// Return NULL on error (out of memory or contradiction)
+struct wfc_image *wfc_run_parallel(const struct wfc_model *model,
+                                   int output_width,
+                                   int output_height,
+                                   unsigned int seed,
+                                   int attempt_cnt,
+                                   int thread_cnt)
 {
-  struct wfc__cell *cell = &( wfc->cells[cell_idx] );
-  int *tiles = cell->tiles;
+  struct wfc_image *image = NULL;
+  struct wfc__stripes stripes;
+  stripes.model = model;
+  stripes.output_width = output_width;
+  stripes.output_height = output_height;
+  stripes.seed = seed;
+  stripes.attempt_cnt = attempt_cnt;
+  stripes.failed = 0;
+
+  // An even stripe per thread, and one fewer odd stripes
+  stripes.stripe_cnt = thread_cnt > 1 ? 2 * thread_cnt - 1 : 1;
+  while (stripes.stripe_cnt > 1 && output_height / stripes.stripe_cnt < 2 * WFC__CHUNK_MARGIN)
+    stripes.stripe_cnt -= 2;
+  stripes.stripe_height = output_height / stripes.stripe_cnt;
+
+  stripes.tiles = malloc(sizeof(*stripes.tiles) * output_width * output_height);
+  if (stripes.tiles == NULL) {
+    p("wfc_run_parallel: error\n");
+    return NULL;
+  }
 
-  // Tile is enabled if any of the cell's tiles allowes it in
-  // the specified diretion
-  int tile_cnt = wfc->tile_cnt;
-  for (int i=0, cnt=cell->tile_cnt; i<cnt; i++) {
-    if (wfc->allowed_tiles[d][tiles[i] * tile_cnt + tile_idx]) {
-      return 1;
-    }
+  wfc__mutex_init(&stripes.mutex);
+  for (int phase=0; phase<2 && !stripes.failed; phase++) {
+    int cnt = (stripes.stripe_cnt + 1 - phase) / 2;
+    stripes.next_stripe = phase;
+    wfc__run_workers(wfc__stripes_worker, &stripes, thread_cnt < cnt ? thread_cnt : cnt);
   }
+  wfc__mutex_destroy(&stripes.mutex);
 
-  return 0;
+  int component_cnt = model->component_cnt;
+  size_t tile_size = (size_t)model->tile_width * model->tile_height * component_cnt;
+  if (!stripes.failed) {
+    image = wfc_img_create(output_width, output_height, component_cnt);
+    if (image == NULL)
+      p("wfc_run_parallel: error\n");
+  }
+  if (image != NULL) {
+    for (int i=0; i<output_width * output_height; i++)
+      memcpy(&image->data[i * component_cnt], &model->tile_pixels[stripes.tiles[i] * tile_size], component_cnt);
+  }
+
+  free(stripes.tiles);
+  return image;
 }
 
-// Checks whether particular prop is already added and pending, in which
-// case there is no point of adding the same prop again.
+////////////////////////////////////////////////////////////////////////////////
 //
-// 1 - prop is added, 0 - prop is not added
-static int wfc__is_prop_pending(struct wfc *wfc, int cell_idx, enum wfc__direction d) {
-  for (int i=wfc->prop_idx+1; i<wfc->prop_cnt; i++) {
-    struct wfc__prop *p = &( wfc->props[i] );
-    if (p->src_cell_idx == cell_idx && p->direction == d) {
-      return 1;
+// WFC: Partial regeneration (Method-independent)
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Sets the collapsed cell to another tile without propagating it
+static void wfc__set_cell_tile(struct wfc_state *state, int cell_idx, int tile_idx)
+{
+  struct wfc__cell *cell = &( state->cells[cell_idx] );
+  memset(cell->tiles, 0, sizeof(*cell->tiles) * state->model->tile_word_cnt);
+  wfc__bit_set(cell->tiles, tile_idx);
+  cell->sum_freqs = state->model->tiles[tile_idx].freq;
+  cell->sum_freq_log_freqs = state->model->freq_log_freqs[tile_idx];
+  wfc__set_tile_cnt(state, cell_idx, 1);
+}
+
+// Recounts the supports of the cells in the rectangle from the tiles of
+// their neighbours, as wfc__init_supports and the bans since would leave
+// them
+static void wfc__recount_supports(struct wfc_state *state, int x, int y, int x_end, int y_end)
+{
+  const struct wfc_model *model = state->model;
+  int tile_cnt = model->tile_cnt;
+  int word_cnt = model->tile_word_cnt;
+
+  for (int j=y; j<y_end; j++) {
+    for (int i=x; i<x_end; i++) {
+      int cell_idx = j * state->output_width + i;
+      int *supports = &( state->supports[(size_t)cell_idx * tile_cnt * 4] );
+      const uint64_t *tiles = state->cells[cell_idx].tiles;
+
+      for (int d=0; d<4; d++) {
+        // Supports in direction d come from the opposite neighbour
+        int src_cell_idx = wfc__neighbour(state, cell_idx, d ^ 1);
+        for (int t=0; t<tile_cnt; t++) {
+          supports[t*4 + d] = src_cell_idx == -1 ? model->initial_supports[t*4 + d] : 0;
+          if (!wfc__bit_test(tiles, t))
+            supports[t*4 + d] += tile_cnt;
+        }
+        if (src_cell_idx == -1)
+          continue;
+
+        const uint64_t *src_tiles = state->cells[src_cell_idx].tiles;
+        for (int w=0; w<word_cnt; w++) {
+          for (uint64_t src_bits=src_tiles[w]; src_bits; src_bits&=src_bits-1) {
+            int src_tile_idx = w * WFC__WORD_BITS + wfc__ctz(src_bits);
+            if (model->neighbours != NULL) {
+              size_t r = (size_t)d * tile_cnt + src_tile_idx;
+              for (int k=model->neighbour_offsets[r]; k<model->neighbour_offsets[r+1]; k++)
+                supports[model->neighbours[k]*4 + d]++;
+              continue;
+            }
+
+            const uint64_t *row = model->allowed_tiles[d] + (size_t)src_tile_idx * word_cnt;
+            for (int v=0; v<word_cnt; v++) {
+              for (uint64_t bits=row[v]; bits; bits&=bits-1)
+                supports[(v * WFC__WORD_BITS + wfc__ctz(bits))*4 + d]++;
+            }
+          }
+        }
+      }
     }
   }
-  return 0;
 }
 
-// Updates tiles in the destination cell to those that are allowed by the source cell
-// and propagate updates
+// Solves the rectangle again in a state of its own, one cell larger on
+// each side. That rim is fixed to the collapsed cells around the
+// rectangle, so the time taken depends on the size of the rectangle and
+// not of the output. The rectangle is clipped to the output. Cells keep
+// to the constraints of wfc_state_constrain. With support propagation the
+// supports of the rectangle and its rim are recounted, so that
+// wfc_state_constrain and wfc_state_run can go on from the state. Earlier
+// decisions can't be backtracked afterwards.
 //
-// Return 0 on error
-static int wfc__propagate_prop(struct wfc *wfc, struct wfc__prop *p)
+// Return 0 on error (out of memory, a cell around the rectangle isn't
+// collapsed, or contradiction), leaving the state untouched
+int wfc_state_regenerate_rect(struct wfc_state *state, int x, int y, int width, int height)
 {
-  int new_cnt = 0;
-
-  struct wfc__cell *dst_cell = &( wfc->cells[ p->dst_cell_idx ] );
-
-  // Go through all destination tiles and check whether they are enabled by the source cell
-  for (int i=0, cnt=dst_cell->tile_cnt; i<cnt; i++) {
-    int possible_dst_tile_idx = dst_cell->tiles[i];
-
-    // If a destination tile is enabled by the source cell, keep it
-    if (wfc__tile_enabled(wfc, possible_dst_tile_idx, p->src_cell_idx, p->direction)) {
-      dst_cell->tiles[new_cnt] = possible_dst_tile_idx;
-      new_cnt++;
-    } else {
-      int freq = wfc->tiles[possible_dst_tile_idx].freq;
-      double p = ((double)freq) / wfc->sum_freqs;
-      dst_cell->entropy += p*log(p);
-      dst_cell->sum_freqs -= freq;
-      if (dst_cell->sum_freqs == 0) // no options left TODO: remove
+  int rv = 0;
+  int w = state->output_width;
+  int x_end = x + width < w ? x + width : w;
+  int y_end = y + height < state->output_height ? y + height : state->output_height;
+  x = x > 0 ? x : 0;
+  y = y > 0 ? y : 0;
+  if (x >= x_end || y >= y_end)
+    return 1;
+
+  int rim_x = x > 0 ? x - 1 : 0;
+  int rim_y = y > 0 ? y - 1 : 0;
+  int rim_x_end = x_end < w ? x_end + 1 : w;
+  int rim_y_end = y_end < state->output_height ? y_end + 1 : state->output_height;
+  int rect_w = rim_x_end - rim_x;
+
+  for (int j=rim_y; j<rim_y_end; j++) {
+    for (int i=rim_x; i<rim_x_end; i++) {
+      if ((i < x || i >= x_end || j < y || j >= y_end) && state->cell_tiles[j * w + i] == -1)
         return 0;
     }
   }
 
-  if (!new_cnt) {
+  struct wfc_state *rect = wfc__state_create(state->model, rect_w, rim_y_end - rim_y);
+  if (rect == NULL) {
+    p("wfc_state_regenerate_rect: error\n");
     return 0;
   }
+  rect->propagation = state->propagation;
+  rect->selection = state->selection;
+  rect->max_backtrack_cnt = state->max_backtrack_cnt;
+  rect->backtrack_depth = state->backtrack_depth;
+  wfc_state_init(rect, wfc__rng_next(&state->rng));
+
+  // Cells keep to their constraints
+  if (state->constrained && state->template_cells != NULL) {
+    wfc__clear_props(rect);
+    for (int j=y; j<y_end; j++) {
+      for (int i=x; i<x_end; i++) {
+        if (!wfc__restrict_cell(rect, (j - rim_y) * rect_w + i - rim_x, state->template_cells[j * w + i].tiles))
+          goto CLEANUP;
+      }
+    }
+    if (!wfc__propagate_queued(rect))
+      goto CLEANUP;
+  }
 
-  if (dst_cell->tile_cnt != new_cnt) {
-    if (new_cnt == 1) wfc->collapsed_cell_cnt++;
-    if (p->direction != WFC_DOWN && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_UP)) wfc__add_prop_up(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_UP && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_DOWN)) wfc__add_prop_down(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_RIGHT && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_LEFT)) wfc__add_prop_left(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_LEFT && !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_RIGHT)) wfc__add_prop_right(wfc, p->dst_cell_idx);
+  for (int j=rim_y; j<rim_y_end; j++) {
+    for (int i=rim_x; i<rim_x_end; i++) {
+      if (i >= x && i < x_end && j >= y && j < y_end)
+        continue;
+      if (!wfc__constrain_cell(rect, (j - rim_y) * rect_w + i - rim_x, state->cell_tiles[j * w + i]))
+        goto CLEANUP;
+    }
   }
 
-  dst_cell->tile_cnt = new_cnt;
+  if (!wfc_state_run(rect, -1))
+    goto CLEANUP;
 
-  return 1;
+  for (int j=y; j<y_end; j++) {
+    for (int i=x; i<x_end; i++)
+      wfc__set_cell_tile(state, j * w + i, rect->cell_tiles[(j - rim_y) * rect_w + i - rim_x]);
+  }
+  if (state->propagation == WFC_PROPAGATION_SUPPORT && state->supports != NULL)
+    wfc__recount_supports(state, rim_x, rim_y, rim_x_end, rim_y_end);
+  wfc__flush_dirty(state, state->selection == WFC_SELECTION_HEAP);
+  state->decision_cnt = 0;
+  state->trail_cnt = 0;
+  rv = 1;
+
+ CLEANUP:
+  wfc_state_destroy(rect);
+  return rv;
 }
 
-// Return 0 on error (contradiction)
-static int wfc__propagate(struct wfc *wfc, int cell_idx)
+int wfc_regenerate_rect(struct wfc *wfc, int x, int y, int width, int height)
 {
-  wfc->prop_cnt = 0;
+  return wfc_state_regenerate_rect(wfc->state, x, y, width, height);
+}
 
-  wfc__add_prop_up(wfc, cell_idx);
-  wfc__add_prop_down(wfc, cell_idx);
-  wfc__add_prop_left(wfc, cell_idx);
-  wfc__add_prop_right(wfc, cell_idx);
+////////////////////////////////////////////////////////////////////////////////
+//
+// WFC: Hierarchical generation (Method-independent)
+//
+////////////////////////////////////////////////////////////////////////////////
 
-  for (int i=0; i<wfc->prop_cnt; i++) {
-    wfc->prop_idx = i;
-    struct wfc__prop *p = &( wfc->props[i] );
-    if (!wfc__propagate_prop(wfc, p)) {
-      return 0;
+// Levels are solved in windows of WFC__LEVEL_WINDOW cells, row after row,
+// each in a state of its own with a rim and a margin as in chunked
+// generation. The rim holds the finished cells above and on the left of
+// the window, fixed to their tiles, and the margin is solved and thrown
+// away. Only the tiles of the levels are kept for the whole output, so
+// memory grows with the window and not with the output, and a failed seed
+// only solves its window again.
+#define WFC__LEVEL_WINDOW 64
+
+// Solving a level of width x height cells, factor times larger than the
+// coarse level above it (coarse_tiles is NULL for the coarsest level)
+struct wfc__level {
+  const struct wfc_model *model;
+  int width;
+  int height;
+  int *tiles;                  // Tiles of the level, finished windows so far
+  const uint64_t *masks;       // Tiles of the model for each coarse tile
+  const int *coarse_tiles;
+  int coarse_width;
+  int coarse_height;
+  int factor;
+};
+
+// Cells above the window, and on the left of it, are finished
+static int wfc__is_window_rim(int x, int y, int window_x, int window_y, int window_end_y)
+{
+  return y < window_y || (y < window_end_y && x < window_x);
+}
+
+// Fixes the rim cells of the state, which starts at state_x, state_y of
+// the level, to their finished tiles
+//
+// Return 0 on error (contradiction)
+static int wfc__constrain_window_rim(struct wfc__level *level, struct wfc_state *state, int state_x, int state_y,
+                                     int window_x, int window_y, int window_end_y)
+{
+  int w = state->output_width;
+  for (int y=0; y<state->output_height; y++) {
+    for (int x=0; x<w; x++) {
+      int level_x = state_x + x;
+      int level_y = state_y + y;
+      if (wfc__is_window_rim(level_x, level_y, window_x, window_y, window_end_y) &&
+          !wfc__constrain_cell(state, y * w + x, level->tiles[level_y * level->width + level_x]))
+        return 0;
     }
   }
-
   return 1;
 }
 
+// Keeps to each cell at a multiple of factor only the tiles with the pixel
+// of the tile of the coarse cell above it, see wfc__img_downsample. Only
+// every other coarse cell does so, in a checkerboard, which leaves the
+// fine rules room to follow the others. Rim cells are already fixed.
+//
 // Return 0 on error (contradiction)
-static int wfc__collapse(struct wfc *wfc, int cell_idx)
+static int wfc__restrict_to_coarse(struct wfc__level *level, struct wfc_state *state, int state_x, int state_y,
+                                   int window_x, int window_y, int window_end_y)
 {
-  int remaining = rand() % wfc->cells[cell_idx].sum_freqs;
-  for (int i=0; i<wfc->cells[cell_idx].tile_cnt; i++) {
-    int freq = wfc->tiles[ wfc->cells[cell_idx].tiles[i] ].freq;
-    if (remaining >= freq) {
-      remaining -= freq;
-    } else {
-      wfc->cells[cell_idx].tiles[0] = wfc->cells[cell_idx].tiles[i];
-      wfc->cells[cell_idx].tile_cnt = 1;
-      wfc->cells[cell_idx].sum_freqs = 0;
-      wfc->cells[cell_idx].entropy = 0;
-      wfc->collapsed_cell_cnt++;
-      return 1;
+  int word_cnt = level->model->tile_word_cnt;
+  int factor = level->factor;
+  int w = state->output_width;
+
+  wfc__clear_props(state);
+  for (int y=0; y<state->output_height; y++) {
+    int level_y = state_y + y;
+    if (level_y % factor != 0 || level_y / factor >= level->coarse_height)
+      continue;
+    for (int x=0; x<w; x++) {
+      int level_x = state_x + x;
+      int coarse_x = level_x / factor;
+      int coarse_y = level_y / factor;
+      if (level_x % factor != 0 || coarse_x >= level->coarse_width || ((coarse_x + coarse_y) & 1) ||
+          wfc__is_window_rim(level_x, level_y, window_x, window_y, window_end_y))
+        continue;
+      int coarse_tile_idx = level->coarse_tiles[coarse_y * level->coarse_width + coarse_x];
+      if (!wfc__restrict_cell(state, y * w + x, level->masks + (size_t)coarse_tile_idx * word_cnt))
+        return 0;
     }
   }
 
-  return 0;
+  if (!wfc__propagate_queued(state))
+    return 0;
+
+  wfc__flush_dirty(state, state->selection == WFC_SELECTION_HEAP);
+  return 1;
 }
 
-static int wfc__next_cell(struct wfc *wfc)
+// Solves the window of the level, trying attempt_cnt seeds following the
+// coarse level, and as many more without it if those fail or the coarse
+// level can't be followed there
+//
+// Return 0 on error (out of memory, the rim can't be met, or all attempts
+// failed)
+static int wfc__solve_window(struct wfc__level *level, int window_x, int window_y,
+                             unsigned int seed, int attempt_cnt)
 {
-  int min_idx = -1;
-  double min_entropy = DBL_MAX;
+  int window_end_x = window_x + WFC__LEVEL_WINDOW < level->width ? window_x + WFC__LEVEL_WINDOW : level->width;
+  int window_end_y = window_y + WFC__LEVEL_WINDOW < level->height ? window_y + WFC__LEVEL_WINDOW : level->height;
+  int state_x = window_x > WFC__CHUNK_RIM ? window_x - WFC__CHUNK_RIM : 0;
+  int state_y = window_y > WFC__CHUNK_RIM ? window_y - WFC__CHUNK_RIM : 0;
+  int state_end_x = window_end_x + WFC__CHUNK_MARGIN < level->width ? window_end_x + WFC__CHUNK_MARGIN : level->width;
+  int state_end_y = window_end_y + WFC__CHUNK_MARGIN < level->height ? window_end_y + WFC__CHUNK_MARGIN : level->height;
+
+  struct wfc_state *state = wfc__state_create(level->model, state_end_x - state_x, state_end_y - state_y);
+  if (state == NULL) {
+    p("wfc__solve_window: error\n");
+    return 0;
+  }
 
-  for (int i=0; i<wfc->cell_cnt; i++) {
-    // Add small noise to break ties between tiles with the same entropy
-    double entropy = wfc->cells[i].entropy + rand() / (100000.0 * RAND_MAX);
-    if (wfc->cells[i].tile_cnt != 1 && entropy < min_entropy) {
-      min_entropy = entropy;
-      min_idx = i;
+  int collapsed = 0;
+  for (int guided=level->coarse_tiles != NULL; guided>=0 && !collapsed; guided--) {
+    for (int i=0; i<attempt_cnt && !collapsed; i++) {
+      wfc_state_init(state, seed + i);
+      // Neither depends on the seed, no use trying again
+      if (!wfc__constrain_window_rim(level, state, state_x, state_y, window_x, window_y, window_end_y))
+        goto CLEANUP;
+      if (guided && !wfc__restrict_to_coarse(level, state, state_x, state_y, window_x, window_y, window_end_y))
+        break;
+      collapsed = wfc_state_run(state, -1);
     }
   }
 
-  return min_idx;
+  if (collapsed) {
+    int w = state->output_width;
+    for (int y=window_y; y<window_end_y; y++) {
+      memcpy(&level->tiles[y * level->width + window_x],
+             &state->cell_tiles[(y - state_y) * w + window_x - state_x],
+             sizeof(*level->tiles) * (window_end_x - window_x));
+    }
+  }
+
+ CLEANUP:
+  wfc_state_destroy(state);
+  return collapsed;
 }
 
-static void wfc__init_cells(struct wfc *wfc)
+// Solves a level of output_width x output_height cells. Below the coarsest
+// level, coarse_tiles are the tiles of the level above, factor times
+// smaller, solved with the coarse model. Window i of the level tries the
+// seeds from seed+i*seed_step.
+//
+// Return tiles of the level, NULL on error (out of memory, or a window
+// couldn't be solved)
+static int *wfc__solve_level(const struct wfc_model *model, int output_width, int output_height,
+                             const struct wfc_model *coarse, const int *coarse_tiles, int factor,
+                             unsigned int seed, unsigned int seed_step, int attempt_cnt)
 {
-  int sum_freqs = 0.0;
-  for (int i=0; i<wfc->tile_cnt; i++)
-    sum_freqs += wfc->tiles[i].freq;
-  wfc->sum_freqs = sum_freqs;
-
-  double sum_plogp = 0.0;
-  for (int i=0; i<wfc->tile_cnt; i++) {
-    double p = ((double)wfc->tiles[i].freq) / sum_freqs;
-    sum_plogp += p*log(p);
+  int rv = 0;
+  int word_cnt = model->tile_word_cnt;
+  uint64_t *masks = NULL;
+  struct wfc__level level;
+  level.model = model;
+  level.width = output_width;
+  level.height = output_height;
+  level.coarse_tiles = coarse_tiles;
+  level.coarse_width = (output_width + factor - 1) / factor;
+  level.coarse_height = (output_height + factor - 1) / factor;
+  level.factor = factor;
+
+  level.tiles = malloc(sizeof(*level.tiles) * output_width * output_height);
+  if (coarse_tiles != NULL)
+    masks = calloc((size_t)coarse->tile_cnt * word_cnt, sizeof(*masks));
+  if (level.tiles == NULL || (coarse_tiles != NULL && masks == NULL)) {
+    p("wfc__solve_level: error\n");
+    goto CLEANUP;
+  }
+  level.masks = masks;
+
+  if (coarse_tiles != NULL) {
+    size_t tile_size = (size_t)model->tile_width * model->tile_height * model->component_cnt;
+    size_t coarse_tile_size = (size_t)coarse->tile_width * coarse->tile_height * coarse->component_cnt;
+    for (int i=0; i<coarse->tile_cnt; i++) {
+      for (int j=0; j<model->tile_cnt; j++) {
+        if (memcmp(&coarse->tile_pixels[i * coarse_tile_size], &model->tile_pixels[j * tile_size], model->component_cnt) == 0)
+          wfc__bit_set(masks + (size_t)i * word_cnt, j);
+      }
+    }
   }
-  double entropy = -sum_plogp;
 
-  for (int i=0; i<wfc->cell_cnt; i++) {
-    wfc->cells[i].tile_cnt = wfc->tile_cnt;
-    wfc->cells[i].sum_freqs = sum_freqs;
-    wfc->cells[i].entropy = entropy;
-    for (int j=0; j<wfc->tile_cnt; j++) {
-      wfc->cells[i].tiles[j] = j;
+  unsigned int window_seed = seed;
+  for (int y=0; y<output_height; y+=WFC__LEVEL_WINDOW) {
+    for (int x=0; x<output_width; x+=WFC__LEVEL_WINDOW) {
+      if (!wfc__solve_window(&level, x, y, window_seed, attempt_cnt))
+        goto CLEANUP;
+      window_seed += seed_step;
     }
   }
+  rv = 1;
 
-  wfc->prop_cnt = 0;
+ CLEANUP:
+  free(masks);
+  if (!rv) {
+    free(level.tiles);
+    level.tiles = NULL;
+  }
+  return level.tiles;
 }
 
-// Allows to call wfc_run again
-void wfc_init(struct wfc *wfc)
+////////////////////////////////////////////////////////////////////////////////
+//
+// WFC: Overlapping method
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Tile with the hash of the part of its image that overlaps a neighbour
+struct wfc__overlap_key {
+  uint64_t hash;
+  int tile_idx;
+};
+
+static int wfc__cmp_overlap_keys(const void *a, const void *b)
 {
-  wfc->seed = (unsigned int) time(NULL); // 1641743677
-  srand(wfc->seed);
-  wfc->collapsed_cell_cnt = 0;
-  wfc__init_cells(wfc);
+  const struct wfc__overlap_key *x = a;
+  const struct wfc__overlap_key *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->tile_idx - y->tile_idx;
 }
 
-// max_collapse_cnt of -1 means no iteration number limit
-//
-// Return 0 on error (contradiction occurred)
-int wfc_run(struct wfc *wfc, int max_collapse_cnt)
+// Hash of the part of the tile image that wfc__img_cmpoverlap compares
+// with the neighbour in the direction, i.e., the image without its edge
+// on the opposite side. Tile b can be next to tile a in the direction d
+// only if the hash of a for d equals the hash of b for the opposite
+// direction d^1.
+static uint64_t wfc__overlap_hash(struct wfc_image *image, enum wfc__direction d)
 {
-  //int cell_idx = (wfc->output_height / 2) * wfc->output_width + wfc->output_width / 2;
-  int cell_idx = rand() % (wfc->output_height * wfc->output_width);
-
-  while (1) {
-    print_progress(wfc->collapsed_cell_cnt);
+  switch (d) {
+  case WFC_UP:
+    return wfc__hash_window(image, 0, 0, image->width, image->height-1);
+  case WFC_DOWN:
+    return wfc__hash_window(image, 0, 1, image->width, image->height-1);
+  case WFC_LEFT:
+    return wfc__hash_window(image, 0, 0, image->width-1, image->height);
+  case WFC_RIGHT:
+    return wfc__hash_window(image, 1, 0, image->width-1, image->height);
+  }
+  return 0;
+}
 
-    if (!wfc__collapse(wfc, cell_idx)) {
-      print_endprogress();
-      return 0;
-    }
+// Rows of the rules shared by the workers, taken in chunks
+struct wfc__rules_job {
+  struct wfc_model *model;
+  struct wfc__overlap_key *keys[4]; // Per direction, sorted by hash
+  int next_row;                // Of 4*tile_cnt rows, direction-major
+  int counting;                // 1 in the first pass, which only counts
+                               // the candidates
+  int *counts;                 // Per row, candidates after the first pass,
+                               // neighbours in lists after the second one
+  wfc__mutex mutex;
+};
 
-    if (!wfc__propagate(wfc, cell_idx)) {
-      print_endprogress();
-      return 0;
-    }
+#define WFC__RULES_CHUNK 64
 
-    cell_idx = wfc__next_cell(wfc);
+// Fills rows of the rules, allowed_tiles or neighbours. Candidates for
+// a row come from the tiles whose overlap hash matches, and are then
+// checked pixel by pixel. The keys of the same hash are sorted by tile, so
+// lists come out in increasing order.
+static void *wfc__rules_worker(void *arg)
+{
+  struct wfc__rules_job *job = arg;
+  struct wfc_model *model = job->model;
+  int tile_cnt = model->tile_cnt;
+  int row_cnt = tile_cnt * 4;
 
-    if (cell_idx == -1 || wfc->collapsed_cell_cnt == max_collapse_cnt) {
+  while (1) {
+    wfc__lock(&job->mutex);
+    int start = job->next_row;
+    job->next_row += WFC__RULES_CHUNK;
+    wfc__unlock(&job->mutex);
+    if (start >= row_cnt)
       break;
+
+    int end = start + WFC__RULES_CHUNK < row_cnt ? start + WFC__RULES_CHUNK : row_cnt;
+    for (int r=start; r<end; r++) {
+      int d = r / tile_cnt;
+      int i = r % tile_cnt;
+      struct wfc__overlap_key *keys = job->keys[d ^ 1];
+      struct wfc_image a = wfc__tile_image(model->tile_pixels, i, model->tile_width, model->tile_height, model->component_cnt);
+
+      // First key of a neighbour with a matching hash
+      uint64_t hash = wfc__overlap_hash(&a, d);
+      int lo = 0, hi = tile_cnt;
+      while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (keys[mid].hash < hash)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+
+      int end_key = lo;
+      while (end_key < tile_cnt && keys[end_key].hash == hash)
+        end_key++;
+      if (job->counting) {
+        job->counts[r] = end_key - lo;
+        continue;
+      }
+
+      int *list = model->neighbours != NULL ? &model->neighbours[model->neighbour_offsets[r]] : NULL;
+      uint64_t *row = model->neighbours == NULL ? model->allowed_tiles[d] + (size_t)i * model->tile_word_cnt : NULL;
+      int cnt = 0;
+      for (int k=lo; k<end_key; k++) {
+        int j = keys[k].tile_idx;
+        struct wfc_image b = wfc__tile_image(model->tile_pixels, j, model->tile_width, model->tile_height, model->component_cnt);
+        if (!wfc__img_cmpoverlap(&a, &b, d))
+          continue;
+        if (list != NULL)
+          list[cnt++] = j;
+        else
+          wfc__bit_set(row, j);
+      }
+      job->counts[r] = cnt;
     }
   }
 
-  print_progress(wfc->collapsed_cell_cnt);
-  print_endprogress();
+  return NULL;
+}
 
-  return 1;
+// Runs a pass of the workers over all rows
+static void wfc__run_rules_job(struct wfc__rules_job *job, int thread_cnt)
+{
+  int chunk_cnt = (job->model->tile_cnt * 4 + WFC__RULES_CHUNK - 1) / WFC__RULES_CHUNK;
+  job->next_row = 0;
+  wfc__mutex_init(&job->mutex);
+  wfc__run_workers(wfc__rules_worker, job, thread_cnt < chunk_cnt ? thread_cnt : chunk_cnt);
+  wfc__mutex_destroy(&job->mutex);
 }
 
-void wfc_destroy(struct wfc *wfc)
+static void wfc__destroy_rules_job(struct wfc__rules_job *job)
 {
-  wfc__destroy_cells(wfc->cells, wfc->cell_cnt);
-  wfc__destroy_tiles(wfc->tiles, wfc->tile_cnt);
-  wfc__destroy_allowed_tiles(wfc->allowed_tiles);
-  wfc__destroy_props(wfc->props);
-  free(wfc);
+  free(job->keys[0]);
+  free(job->counts);
 }
 
-////////////////////////////////////////////////////////////////////////////////
+// Sorts the overlap hashes of the model's tiles and counts the candidates
+// of each row in job->counts
 //
-// WFC: Overlapping method
-//
-////////////////////////////////////////////////////////////////////////////////
-
-static void wfc__compute_allowed_tiles(int *allowed_tiles[4], struct wfc__tile *tiles, int tile_cnt)
+// Return the number of candidates, which lists need room for, -1 on error
+static long long wfc__count_rules(struct wfc__rules_job *job, struct wfc_model *model, int thread_cnt)
 {
+  int tile_cnt = model->tile_cnt;
+  int row_cnt = tile_cnt * 4;
+  job->model = model;
+
+  job->keys[0] = malloc(sizeof(*job->keys[0]) * tile_cnt * 4);
+  job->counts = malloc(sizeof(*job->counts) * row_cnt);
+  if (job->keys[0] == NULL || job->counts == NULL) {
+    p("wfc__count_rules: error\n");
+    wfc__destroy_rules_job(job);
+    return -1;
+  }
+
   for (int d=0; d<4; d++) {
+    job->keys[d] = job->keys[0] + (size_t)d * tile_cnt;
     for (int i=0; i<tile_cnt; i++) {
-      for (int j=0; j<tile_cnt; j++) {
-        //if (i==j)
-        //  continue;
-        allowed_tiles[d][i*tile_cnt + j] = wfc__img_cmpoverlap(tiles[i].image, tiles[j].image, d);
-      }
+      struct wfc_image tile_image = wfc__tile_image(model->tile_pixels, i, model->tile_width, model->tile_height, model->component_cnt);
+      job->keys[d][i].hash = wfc__overlap_hash(&tile_image, d);
+      job->keys[d][i].tile_idx = i;
+    }
+    qsort(job->keys[d], tile_cnt, sizeof(*job->keys[d]), wfc__cmp_overlap_keys);
+  }
+
+  job->counting = 1;
+  wfc__run_rules_job(job, thread_cnt);
+
+  long long candidate_cnt = 0;
+  for (int r=0; r<row_cnt; r++)
+    candidate_cnt += job->counts[r];
+  return candidate_cnt;
+}
+
+// Lists are used when the rules are sparse, or when allowed_tiles would
+// exceed rule_cap bytes (0 for no cap)
+static int wfc__pick_neighbour_lists(int tile_cnt, long long candidate_cnt, size_t rule_cap)
+{
+  return wfc__use_neighbour_lists(tile_cnt, candidate_cnt) ||
+         (rule_cap > 0 && wfc__rule_bytes(tile_cnt, 0, 0) > rule_cap);
+}
+
+// Builds the rules in two passes over the rows. The first one counts the
+// candidates of each row, which decides between allowed_tiles and lists,
+// and the second one fills them. Lists get room for all candidates and are
+// packed afterwards. Rules over rule_cap bytes (0 for no cap) are not
+// built.
+//
+// Return 0 on error
+static int wfc__compute_rules(struct wfc_model *model, int thread_cnt, size_t rule_cap)
+{
+  int rv = 0;
+  int tile_cnt = model->tile_cnt;
+  int row_cnt = tile_cnt * 4;
+  struct wfc__rules_job job;
+
+  long long candidate_cnt = wfc__count_rules(&job, model, thread_cnt);
+  if (candidate_cnt < 0)
+    return 0;
+
+  int lists = wfc__pick_neighbour_lists(tile_cnt, candidate_cnt, rule_cap);
+  if (rule_cap > 0 && wfc__rule_bytes(tile_cnt, lists, candidate_cnt) > rule_cap) {
+    p("wfc__compute_rules: error (over the memory cap)\n");
+    goto CLEANUP;
+  }
+
+  if (lists) {
+    if (!wfc__create_neighbours(model, candidate_cnt))
+      goto CLEANUP;
+    int offset = 0;
+    for (int r=0; r<row_cnt; r++) {
+      model->neighbour_offsets[r] = offset;
+      offset += job.counts[r];
+    }
+    model->neighbour_offsets[row_cnt] = offset;
+  } else if (!wfc__create_allowed_tiles(model->allowed_tiles, tile_cnt, model->tile_word_cnt)) {
+    goto CLEANUP;
+  }
+
+  job.counting = 0;
+  wfc__run_rules_job(&job, thread_cnt);
+
+  // Pack the lists, dropping candidates that didn't match
+  if (model->neighbours != NULL) {
+    int offset = 0;
+    for (int r=0; r<row_cnt; r++) {
+      int start = model->neighbour_offsets[r];
+      model->neighbour_offsets[r] = offset;
+      memmove(&model->neighbours[offset], &model->neighbours[start], sizeof(*model->neighbours) * job.counts[r]);
+      offset += job.counts[r];
     }
+    model->neighbour_offsets[row_cnt] = offset;
+
+    int *neighbours = realloc(model->neighbours, sizeof(*neighbours) * (offset > 0 ? offset : 1));
+    if (neighbours != NULL)
+      model->neighbours = neighbours;
   }
+  rv = 1;
+
+ CLEANUP:
+  wfc__destroy_rules_job(&job);
+  return rv;
 }
 
 // Return NULL on error
@@ -1184,11 +4806,16 @@ static struct wfc__tile *wfc__create_tiles_overlapping(struct wfc_image *image,
                                                 int xflip_tiles,
                                                 int yflip_tiles,
                                                 int rotate_tiles,
-                                                int *tile_cnt)
+                                                int *tile_cnt,
+                                                unsigned char **tile_pixels)
 {
   int xcnt = image->width - tile_width + 1;
   int ycnt = image->height - tile_height + 1;
 
+  struct wfc__tile_set set;
+  if (!wfc__create_tile_set(&set, 64, tile_width, tile_height, image->component_cnt))
+    return NULL;
+
   if (expand_image) {
     xcnt = image->width;
     ycnt = image->height;
@@ -1197,44 +4824,35 @@ static struct wfc__tile *wfc__create_tiles_overlapping(struct wfc_image *image,
       goto CLEANUP;
   }
 
-  *tile_cnt = xcnt * ycnt;
-  if (xflip_tiles)
-    *tile_cnt *= 2;
-  // xflip_tiles + rotate_tiles generate yflip_tiles
-  if (!(xflip_tiles && rotate_tiles) && yflip_tiles)
-    *tile_cnt *= 2;
-  if (rotate_tiles)
-    *tile_cnt *= 4;
-
-  struct wfc__tile *tiles = wfc__create_tiles(*tile_cnt);
-  if (tiles == NULL)
-    goto CLEANUP;
-
-
-  if (!wfc__add_overlapping_images(tiles, image, xcnt, ycnt, tile_width, tile_height))
+  if (!wfc__add_overlapping_images(&set, image, xcnt, ycnt))
     goto CLEANUP;
 
-  int base_tile_cnt = xcnt * ycnt;
   if (xflip_tiles) {
-    if (!wfc__add_flipped_images(tiles, base_tile_cnt, 0))
+    if (!wfc__add_flipped_images(&set, 0))
       goto CLEANUP;
-    base_tile_cnt *= 2;
   }
 
+  // xflip_tiles + rotate_tiles generate yflip_tiles
   if (!(xflip_tiles && rotate_tiles) && yflip_tiles) {
-    if (!wfc__add_flipped_images(tiles, base_tile_cnt, 1))
+    if (!wfc__add_flipped_images(&set, 1))
       goto CLEANUP;
-    base_tile_cnt *= 2;
   }
 
   if (rotate_tiles) {
-    if (!wfc__add_rotated_images(tiles, base_tile_cnt))
+    if (!wfc__add_rotated_images(&set))
       goto CLEANUP;
-    base_tile_cnt *= 4;
   }
 
-  if (!wfc__remove_duplicate_tiles(&tiles, tile_cnt))
-    goto CLEANUP;
+  struct wfc__tile *tiles = realloc(set.tiles, sizeof(*tiles) * set.tile_cnt);
+  if (tiles == NULL)
+    tiles = set.tiles;
+  *tile_pixels = realloc(set.pixels, (size_t)set.tile_cnt * tile_width * tile_height * image->component_cnt);
+  if (*tile_pixels == NULL)
+    *tile_pixels = set.pixels;
+  *tile_cnt = set.tile_cnt;
+  free(set.hashes);
+  free(set.slots);
+  wfc_img_destroy(set.scratch);
 
   // If expand_image is set it means we've created a new image which
   // now needs to be destroyed
@@ -1245,11 +4863,187 @@ static struct wfc__tile *wfc__create_tiles_overlapping(struct wfc_image *image,
 CLEANUP:
   p("wfc__create_tiles_overlapping: error\n");
   wfc_img_destroy(expand_image ? image : NULL);
-  wfc__destroy_tiles(tiles, base_tile_cnt);
+  wfc__destroy_tile_set(&set);
+
+  return NULL;
+}
+
+// Rules go to lists when allowed_tiles would take the model over the cap,
+// and aren't built when lists would too
+//
+// Return NULL on error
+struct wfc_model *wfc_model_overlapping_capped(struct wfc_image *image,
+                                               int tile_width,
+                                               int tile_height,
+                                               int expand_input,
+                                               int xflip_tiles,
+                                               int yflip_tiles,
+                                               int rotate_tiles,
+                                               int thread_cnt,
+                                               size_t memory_cap)
+{
+  WFC__STAT(long long start_ns = wfc__now_ns(), tiles_ns);
+  size_t rule_cap = 0;
+  struct wfc_model *model = malloc(sizeof(*model));
+  if (model == NULL)
+    goto CLEANUP;
+
+  model->method = WFC_METHOD_OVERLAPPING;
+  model->tiles = NULL;
+  model->tile_pixels = NULL;
+  model->allowed_tiles[0] = NULL;
+  model->neighbours = NULL;
+  model->neighbour_offsets = NULL;
+  model->initial_supports = NULL;
+  model->freq_log_freqs = NULL;
+  model->tile_width = tile_width;
+  model->tile_height = tile_height;
+  model->component_cnt = image->component_cnt;
+  model->tile_cnt = 0;
+  model->expand_input = expand_input;
+  model->xflip_tiles = xflip_tiles;
+  model->yflip_tiles = yflip_tiles;
+  model->rotate_tiles = rotate_tiles;
+  model->memory_cap = memory_cap;
+  WFC__STAT(memset(&model->stats, 0, sizeof(model->stats)));
+
+  model->tiles = wfc__create_tiles_overlapping(image,
+                                               model->tile_width,
+                                               model->tile_height,
+                                               model->expand_input,
+                                               model->xflip_tiles,
+                                               model->yflip_tiles,
+                                               model->rotate_tiles,
+                                               &model->tile_cnt,
+                                               &model->tile_pixels);
+  if (model->tiles == NULL)
+    goto CLEANUP;
+  WFC__STAT(tiles_ns = wfc__now_ns());
+  WFC__STAT(model->stats.tiles_ns = tiles_ns - start_ns);
+
+  model->tile_word_cnt = wfc__word_cnt(model->tile_cnt);
+  if (memory_cap > 0) {
+    size_t tile_bytes = sizeof(*model) + wfc__tile_bytes(model->tile_cnt, tile_width, tile_height, model->component_cnt);
+    if (tile_bytes >= memory_cap)
+      goto CLEANUP;
+    rule_cap = memory_cap - tile_bytes;
+  }
+  if (!wfc__compute_rules(model, thread_cnt, rule_cap))
+    goto CLEANUP;
+  WFC__STAT(model->stats.rules_ns = wfc__now_ns() - tiles_ns);
+
+  if (!wfc__init_model(model))
+    goto CLEANUP;
+
+  return model;
 
+ CLEANUP:
+  p("wfc_model_overlapping: error\n");
+  wfc_model_destroy(model);
   return NULL;
 }
 
+// Return NULL on error
+struct wfc_model *wfc_model_overlapping(struct wfc_image *image,
+                                        int tile_width,
+                                        int tile_height,
+                                        int expand_input,
+                                        int xflip_tiles,
+                                        int yflip_tiles,
+                                        int rotate_tiles,
+                                        int thread_cnt)
+{
+  return wfc_model_overlapping_capped(image, tile_width, tile_height, expand_input,
+                                      xflip_tiles, yflip_tiles, rotate_tiles, thread_cnt, 0);
+}
+
+// Counts the rules from the overlap hashes, as wfc_model_overlapping
+// allocates them
+//
+// Return 0 on error, or if wfc_model_overlapping_capped would fail for
+// memory_cap, in which case memory is still filled
+int wfc_estimate_memory(struct wfc_image *image,
+                        int tile_width,
+                        int tile_height,
+                        int expand_input,
+                        int xflip_tiles,
+                        int yflip_tiles,
+                        int rotate_tiles,
+                        int output_width,
+                        int output_height,
+                        size_t memory_cap,
+                        struct wfc_memory *memory)
+{
+  struct wfc_model model;
+  model.tile_width = tile_width;
+  model.tile_height = tile_height;
+  model.component_cnt = image->component_cnt;
+  model.tile_pixels = NULL;
+  model.tiles = wfc__create_tiles_overlapping(image, tile_width, tile_height, expand_input,
+                                              xflip_tiles, yflip_tiles, rotate_tiles,
+                                              &model.tile_cnt, &model.tile_pixels);
+  if (model.tiles == NULL) {
+    p("wfc_estimate_memory: error\n");
+    return 0;
+  }
+
+  struct wfc__rules_job job;
+  long long candidate_cnt = wfc__count_rules(&job, &model, 1);
+  free(model.tiles);
+  free(model.tile_pixels);
+  if (candidate_cnt < 0) {
+    p("wfc_estimate_memory: error\n");
+    return 0;
+  }
+  wfc__destroy_rules_job(&job);
+
+  int tile_cnt = model.tile_cnt;
+  int word_cnt = wfc__word_cnt(tile_cnt);
+  int cell_cnt = output_width * output_height;
+  memory->tile_cnt = tile_cnt;
+  memory->tile_bytes = wfc__tile_bytes(tile_cnt, tile_width, tile_height, image->component_cnt);
+
+  size_t rule_cap = 0;
+  int fits = 1;
+  if (memory_cap > 0) {
+    size_t tile_bytes = sizeof(model) + memory->tile_bytes;
+    if (tile_bytes >= memory_cap)
+      fits = 0;
+    else
+      rule_cap = memory_cap - tile_bytes;
+  }
+  memory->neighbour_lists = wfc__pick_neighbour_lists(tile_cnt, candidate_cnt, rule_cap);
+  memory->rule_bytes = wfc__rule_bytes(tile_cnt, memory->neighbour_lists, candidate_cnt);
+  memory->model_bytes = sizeof(model) + memory->tile_bytes + memory->rule_bytes;
+  if (rule_cap > 0 && memory->rule_bytes > rule_cap)
+    fits = 0;
+
+  memory->cell_bytes = wfc__cell_bytes(cell_cnt, word_cnt);
+  memory->prop_bytes = wfc__prop_bytes(cell_cnt);
+  memory->state_bytes = wfc__state_bytes(cell_cnt, word_cnt);
+  memory->template_bytes = wfc__cell_bytes(cell_cnt, word_cnt);
+  memory->support_bytes = wfc__support_bytes(cell_cnt, tile_cnt) + sizeof(int) * 4 * (size_t)cell_cnt * tile_cnt;
+  return fits;
+}
+
+// Key of the model wfc_model_overlapping builds from the same arguments,
+// used with wfc_model_save and wfc_model_load
+unsigned long long wfc_model_key(struct wfc_image *image,
+                                 int tile_width,
+                                 int tile_height,
+                                 int expand_input,
+                                 int xflip_tiles,
+                                 int yflip_tiles,
+                                 int rotate_tiles)
+{
+  int32_t params[11] = {WFC__MODEL_VERSION, WFC_METHOD_OVERLAPPING,
+                        image->width, image->height, image->component_cnt,
+                        tile_width, tile_height, expand_input,
+                        xflip_tiles, yflip_tiles, rotate_tiles};
+  uint64_t h = wfc__hash_bytes(WFC__HASH_SEED, (const unsigned char *)params, sizeof(params));
+  return wfc__hash_bytes(h, image->data, (size_t)image->width * image->height * image->component_cnt);
+}
+
 // Return NULL on error
 struct wfc *wfc_overlapping(int output_width,
                             int output_height,
@@ -1265,50 +5059,23 @@ struct wfc *wfc_overlapping(int output_width,
   if (wfc == NULL)
     goto CLEANUP;
 
-  wfc->method = WFC_METHOD_OVERLAPPING;
   wfc->image = image;
-  wfc->cells = NULL;
-  wfc->tiles = NULL;
-  wfc->props = NULL;
-  wfc->output_width = output_width;
-  wfc->output_height = output_height;
-  wfc->cell_cnt = output_width * output_height;
-  wfc->tile_width = tile_width;
-  wfc->tile_height = tile_height;
-  wfc->tile_cnt = 0;
-  wfc->expand_input = expand_input;
-  wfc->xflip_tiles = xflip_tiles;
-  wfc->yflip_tiles = yflip_tiles;
-  wfc->rotate_tiles = rotate_tiles;
-  // use entropy
-  // ...
-
-  wfc->tiles = wfc__create_tiles_overlapping(wfc->image,
-                                             wfc->tile_width,
-                                             wfc->tile_height,
-                                             wfc->expand_input,
-                                             wfc->xflip_tiles,
-                                             wfc->yflip_tiles,
-                                             rotate_tiles,
-                                             &wfc->tile_cnt);
-  if (wfc->tiles == NULL)
-    goto CLEANUP;
-
-  if (!wfc__create_allowed_tiles(wfc->allowed_tiles, wfc->tile_cnt)) {
-      goto CLEANUP;
-    }
-  wfc__compute_allowed_tiles(wfc->allowed_tiles, wfc->tiles, wfc->tile_cnt);
-
-  wfc->cells = wfc__create_cells(wfc->cell_cnt, wfc->tile_cnt);
-  if (wfc->cells == NULL)
+  wfc->state = NULL;
+  wfc->model = wfc_model_overlapping(image,
+                                     tile_width,
+                                     tile_height,
+                                     expand_input,
+                                     xflip_tiles,
+                                     yflip_tiles,
+                                     rotate_tiles,
+                                     1);
+  if (wfc->model == NULL)
     goto CLEANUP;
 
-  wfc->props = wfc__create_props(wfc->cell_cnt);
-  if (wfc->props == NULL)
+  wfc->state = wfc_state_create(wfc->model, output_width, output_height);
+  if (wfc->state == NULL)
     goto CLEANUP;
 
-  wfc_init(wfc);
-
   return wfc;
 
  CLEANUP:
@@ -1317,6 +5084,80 @@ struct wfc *wfc_overlapping(int output_width,
   return NULL;
 }
 
+// Solves level_cnt levels, each half the size of the next one. Level i
+// (0 being the output) has its own model built from the image downsampled
+// 2^i times. Cells at even positions of a level keep only the tiles with
+// the pixel of the cell above them, in a checkerboard, so the output
+// follows the large features of the coarse levels. Levels are solved in
+// windows, see WFC__LEVEL_WINDOW, each window getting attempt_cnt seeds.
+// A coarse level that can't be solved leaves the next one unguided.
+// level_cnt is lowered while the smallest image would be smaller than a
+// tile.
+//
+// Return NULL on error (out of memory, or the output couldn't be solved)
+struct wfc_image *wfc_overlapping_hierarchical(struct wfc_image *image,
+                                               int tile_width,
+                                               int tile_height,
+                                               int expand_input,
+                                               int xflip_tiles,
+                                               int yflip_tiles,
+                                               int rotate_tiles,
+                                               int thread_cnt,
+                                               int output_width,
+                                               int output_height,
+                                               int level_cnt,
+                                               unsigned int seed,
+                                               int attempt_cnt)
+{
+  struct wfc_image *output = NULL;
+  struct wfc_model *coarse = NULL;
+  int *coarse_tiles = NULL;
+
+  while (level_cnt > 1 && ((image->width >> (level_cnt-1)) < tile_width ||
+                           (image->height >> (level_cnt-1)) < tile_height))
+    level_cnt--;
+
+  for (int level=level_cnt-1; level>=0; level--) {
+    int factor = 1 << level;
+    struct wfc_image *level_image = level > 0 ? wfc__img_downsample(image, factor) : image;
+    struct wfc_model *model = NULL;
+    if (level_image != NULL) {
+      model = wfc_model_overlapping(level_image, tile_width, tile_height, expand_input,
+                                    xflip_tiles, yflip_tiles, rotate_tiles, thread_cnt);
+    }
+    if (level > 0)
+      wfc_img_destroy(level_image);
+    if (model == NULL)
+      goto CLEANUP;
+
+    int *tiles = wfc__solve_level(model,
+                                  (output_width + factor - 1) / factor,
+                                  (output_height + factor - 1) / factor,
+                                  coarse, coarse_tiles, 2,
+                                  seed + (unsigned int)level * attempt_cnt,
+                                  (unsigned int)level_cnt * attempt_cnt, attempt_cnt);
+    wfc_model_destroy(coarse);
+    free(coarse_tiles);
+    coarse = model;
+    coarse_tiles = tiles;
+    if (tiles == NULL && level == 0)
+      goto CLEANUP;
+  }
+
+  int component_cnt = coarse->component_cnt;
+  size_t tile_size = (size_t)coarse->tile_width * coarse->tile_height * component_cnt;
+  output = wfc_img_create(output_width, output_height, component_cnt);
+  if (output == NULL)
+    goto CLEANUP;
+  for (int i=0; i<output_width * output_height; i++)
+    memcpy(&output->data[i * component_cnt], &coarse->tile_pixels[coarse_tiles[i] * tile_size], component_cnt);
+
+ CLEANUP:
+  wfc_model_destroy(coarse);
+  free(coarse_tiles);
+  return output;
+}
+
 #endif // WFC_IMPLEMENTATION
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,340 @@
+// wfcbench
+//
+// License: MIT
+//
+// Benchmark of wfc.h. For every input image and tile size it times the
+// model construction, and for every output size a number of seeded solves.
+// Results are printed as CSV or JSON, one row per input, tile size and
+// output size, so that runs before and after a change can be compared.
+//
+// COMPILING
+// =============================================================================
+//
+// wfcbench depends on stb_image.h and stb_write.h, like wfctool. Place both
+// files in the same directory as wfcbench.c.
+//
+//         make bench
+//
+// or
+//
+//         cc wfcbench.c -O3 -o wfcbench -lm -lpthread
+//         ./wfcbench samples/*.png > bench.csv
+//
+// Columns:
+//
+//         sample            Input image
+//         tile_size         Tiles are tile_size x tile_size
+//         output_size       Outputs are output_size x output_size
+//         tile_cnt          Unique tiles of the model
+//         build_ms          Median time of building the model
+//         runs              Seeded solves, run i uses seed i+1
+//         success_rate      Solves that collapsed all cells in time
+//         median_solve_ms   Median time of the solves, failed ones included
+//         cells_per_sec     Cells collapsed per second over all solves
+//         peak_rss_kb       Peak resident memory of the process so far
+//
+
+#include <stdio.h>
+#include <sys/resource.h>
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image.h"
+#include "stb_image_write.h"
+#define WFC_IMPLEMENTATION
+#define WFC_USE_STB
+#define WFC_USE_PTHREADS
+#include "wfc.h"
+
+#define MAX_LIST 16
+
+struct options {
+  int sizes[MAX_LIST];         // Output sizes
+  int size_cnt;
+  int tile_sizes[MAX_LIST];
+  int tile_size_cnt;
+  int run_cnt;                 // Solves per output size, and builds per
+                               // tile size
+  int timeout;                 // Seconds per solve, longer ones fail
+  int support;                 // Support propagation instead of scans
+  int thread_cnt;              // Threads building the rules
+  int json;                    // JSON instead of CSV
+};
+
+void usage(const char *program_name, int exit_code)
+{
+  if (exit_code != EXIT_SUCCESS) {
+    printf("Wrong input\n\n");
+  }
+
+  printf("\
+Benchmark of wfc.h over input images.\
+\n\n\
+");
+  printf("\
+Usage:\n\
+  %s [OPTIONS] input_image...\n\n", program_name);
+  printf("\
+Following options are available:\n\n\
+  --sizes=n,n,...                     Output sizes, 64,128,256,512 by default\n\
+  --tile-sizes=n,n,...                Tile sizes, 2,3 by default\n\
+  -n num, --runs=num                  Solves per output size, 5 by default\n\
+  --timeout=num                       Seconds per solve, 60 by default\n\
+  --support=0|1                       Use support propagation\n\
+  -t num, --threads=num               Threads used to build the rules\n\
+  --format=csv|json                   Output format, csv by default\n\
+\n\
+");
+
+  printf("\
+Example:\n\
+  ./wfcbench --sizes=64,128 --runs=3 samples/*.png > bench.csv\n\n\
+");
+
+  exit(exit_code);
+}
+
+// Return the value of --long_name=value, NULL for other arguments
+const char *arg_value(const char *arg, const char *long_name)
+{
+  size_t len = strlen(long_name);
+  if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, long_name, len) != 0 || arg[2 + len] != '=')
+    return NULL;
+  return arg + 3 + len;
+}
+
+// Parses a comma separated list of positive numbers
+//
+// Return the number of parsed numbers, 0 on error
+int parse_list(const char *str, int *list)
+{
+  int cnt = 0;
+  while (*str) {
+    char *end;
+    long n = strtol(str, &end, 10);
+    if (end == str || n <= 0 || cnt == MAX_LIST)
+      return 0;
+    list[cnt++] = (int)n;
+    str = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0')
+      return 0;
+  }
+  return cnt;
+}
+
+// Can terminate the program if the arguments are incorrect
+//
+// Return index of the first input image
+int read_args(int argc, const char **argv, struct options *options)
+{
+  int i = 1;
+  for (; i<argc; i++) {
+    const char *value;
+    if ((value = arg_value(argv[i], "sizes")) != NULL) {
+      options->size_cnt = parse_list(value, options->sizes);
+      if (!options->size_cnt)
+        usage(argv[0], EXIT_FAILURE);
+    } else if ((value = arg_value(argv[i], "tile-sizes")) != NULL) {
+      options->tile_size_cnt = parse_list(value, options->tile_sizes);
+      if (!options->tile_size_cnt)
+        usage(argv[0], EXIT_FAILURE);
+    } else if ((value = arg_value(argv[i], "runs")) != NULL) {
+      if (sscanf(value, "%d", &options->run_cnt) != 1 || options->run_cnt <= 0)
+        usage(argv[0], EXIT_FAILURE);
+    } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%d", &options->run_cnt) != 1 || options->run_cnt <= 0)
+        usage(argv[0], EXIT_FAILURE);
+    } else if ((value = arg_value(argv[i], "timeout")) != NULL) {
+      if (sscanf(value, "%d", &options->timeout) != 1 || options->timeout <= 0)
+        usage(argv[0], EXIT_FAILURE);
+    } else if ((value = arg_value(argv[i], "support")) != NULL) {
+      if (sscanf(value, "%d", &options->support) != 1)
+        usage(argv[0], EXIT_FAILURE);
+    } else if ((value = arg_value(argv[i], "threads")) != NULL) {
+      if (sscanf(value, "%d", &options->thread_cnt) != 1 || options->thread_cnt <= 0)
+        usage(argv[0], EXIT_FAILURE);
+    } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%d", &options->thread_cnt) != 1 || options->thread_cnt <= 0)
+        usage(argv[0], EXIT_FAILURE);
+    } else if ((value = arg_value(argv[i], "format")) != NULL) {
+      if (strcmp(value, "csv") != 0 && strcmp(value, "json") != 0)
+        usage(argv[0], EXIT_FAILURE);
+      options->json = strcmp(value, "json") == 0;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0], EXIT_FAILURE);
+    } else {
+      break;
+    }
+  }
+
+  if (i == argc)
+    usage(argv[0], EXIT_FAILURE);
+
+  return i;
+}
+
+int cmp_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts times
+double median_ms(long long *times, int cnt)
+{
+  qsort(times, cnt, sizeof(*times), cmp_ns);
+  if (cnt % 2)
+    return times[cnt / 2] / 1e6;
+  return (times[cnt / 2 - 1] + times[cnt / 2]) / 2e6;
+}
+
+long peak_rss_kb(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return -1;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Builds the model of the image with the tile size and prints a row per
+// output size
+//
+// Return 0 on error
+int bench_tile_size(const struct options *options, const char *filename, struct wfc_image *image, int tile_size, int *row_cnt)
+{
+  long long *times = malloc(sizeof(*times) * options->run_cnt);
+  if (times == NULL)
+    return 0;
+
+  struct wfc_model *model = NULL;
+  for (int i=0; i<options->run_cnt; i++) {
+    wfc_model_destroy(model);
+    long long start_ns = wfc__now_ns();
+    model = wfc_model_overlapping(image, tile_size, tile_size, 1, 1, 1, 1, options->thread_cnt);
+    times[i] = wfc__now_ns() - start_ns;
+    if (model == NULL) {
+      fprintf(stderr, "%s: cannot build the model for tile size %d\n", filename, tile_size);
+      free(times);
+      return 0;
+    }
+  }
+  double build_ms = median_ms(times, options->run_cnt);
+
+  for (int s=0; s<options->size_cnt; s++) {
+    int size = options->sizes[s];
+    struct wfc_state *state = wfc_state_create(model, size, size);
+    if (state == NULL) {
+      fprintf(stderr, "%s: cannot create a %dx%d state\n", filename, size, size);
+      continue;
+    }
+    if (options->support)
+      state->propagation = WFC_PROPAGATION_SUPPORT;
+
+    int success_cnt = 0;
+    long long cell_cnt = 0;
+    long long total_ns = 0;
+    for (int i=0; i<options->run_cnt; i++) {
+      wfc_state_init(state, i+1);
+      long long start_ns = wfc__now_ns();
+      int rv = wfc_state_run_for(state, options->timeout * 1000000000LL);
+      times[i] = wfc__now_ns() - start_ns;
+      total_ns += times[i];
+      cell_cnt += state->collapsed_cell_cnt;
+      success_cnt += rv == WFC_RUN_DONE;
+    }
+    wfc_state_destroy(state);
+
+    double success_rate = (double)success_cnt / options->run_cnt;
+    double cells_per_sec = total_ns > 0 ? cell_cnt / (total_ns / 1e9) : 0.0;
+    double solve_ms = median_ms(times, options->run_cnt);
+    if (options->json) {
+      printf("%s  {\"sample\": \"%s\", \"tile_size\": %d, \"output_size\": %d, \"tile_cnt\": %d, "
+             "\"build_ms\": %.3f, \"runs\": %d, \"success_rate\": %.3f, \"median_solve_ms\": %.3f, "
+             "\"cells_per_sec\": %.0f, \"peak_rss_kb\": %ld}",
+             *row_cnt ? ",\n" : "", filename, tile_size, size, model->tile_cnt, build_ms,
+             options->run_cnt, success_rate, solve_ms, cells_per_sec, peak_rss_kb());
+    } else {
+      printf("%s,%d,%d,%d,%.3f,%d,%.3f,%.3f,%.0f,%ld\n", filename, tile_size, size, model->tile_cnt,
+             build_ms, options->run_cnt, success_rate, solve_ms, cells_per_sec, peak_rss_kb());
+    }
+    fflush(stdout);
+    (*row_cnt)++;
+  }
+
+  wfc_model_destroy(model);
+  free(times);
+  return 1;
+}
+
+int main(int argc, const char **argv)
+{
+  struct options options = {
+    .sizes = {64, 128, 256, 512},
+    .size_cnt = 4,
+    .tile_sizes = {2, 3},
+    .tile_size_cnt = 2,
+    .run_cnt = 5,
+    .timeout = 60,
+    .support = 0,
+    .thread_cnt = 1,
+    .json = 0,
+  };
+  int first_input = read_args(argc, argv, &options);
+  int rv = EXIT_SUCCESS;
+  int row_cnt = 0;
+
+  if (options.json)
+    printf("[\n");
+  else
+    printf("sample,tile_size,output_size,tile_cnt,build_ms,runs,success_rate,median_solve_ms,cells_per_sec,peak_rss_kb\n");
+
+  for (int i=first_input; i<argc; i++) {
+    struct wfc_image *image = wfc_img_load(argv[i]);
+    if (image == NULL) {
+      fprintf(stderr, "Error: cannot load image: %s\n", argv[i]);
+      rv = EXIT_FAILURE;
+      continue;
+    }
+
+    for (int t=0; t<options.tile_size_cnt; t++) {
+      if (!bench_tile_size(&options, argv[i], image, options.tile_sizes[t], &row_cnt))
+        rv = EXIT_FAILURE;
+    }
+    wfc_img_destroy(image);
+  }
+
+  if (options.json)
+    printf("\n]\n");
+
+  return rv;
+}
+
+/*******************************************************************************
+  LICENSE:
+
+  the MIT License (MIT)
+
+  Copyright (c) 2020 Krystian Samp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*******************************************************************************/
@@ -39,26 +39,29 @@
 #include "stb_image_write.h"
 #define WFC_IMPLEMENTATION
 #define WFC_USE_STB
+#define WFC_USE_PTHREADS
+#define WFC_USE_STATS
 #include "wfc.h"
 
-void print_summary(struct wfc *wfc, const char *input_image, const char *output_image)
+void print_summary(struct wfc_model *model, struct wfc_image *image, unsigned int seed, int output_width, int output_height,
+                   const char *input_image, const char *output_image)
 {
   printf("\n");
-  printf("method:               %s\n", wfc->method == WFC_METHOD_OVERLAPPING ? "overlapping" : "tiled");
-  printf("seed:                 %u\n\n", wfc->seed);
+  printf("method:               %s\n", model->method == WFC_METHOD_OVERLAPPING ? "overlapping" : "tiled");
+  printf("seed:                 %u\n\n", seed);
   printf("input image:          %s\n", input_image);
-  printf("input size:           %dx%d\n", wfc->image->width, wfc->image->height);
-  printf("input components:     %d\n", wfc->image->component_cnt);
-  printf("tile size:            %dx%d\n", wfc->tile_width, wfc->tile_height);
-  printf("expand input:         %d\n", wfc->expand_input);
-  printf("xflip tiles:          %d\n", wfc->xflip_tiles);
-  printf("yflip tiles:          %d\n", wfc->yflip_tiles);
-  printf("rotate tiles:         %d\n", wfc->rotate_tiles);
-  printf("tile count:           %d\n", wfc->tile_cnt);
+  printf("input size:           %dx%d\n", image->width, image->height);
+  printf("input components:     %d\n", image->component_cnt);
+  printf("tile size:            %dx%d\n", model->tile_width, model->tile_height);
+  printf("expand input:         %d\n", model->expand_input);
+  printf("xflip tiles:          %d\n", model->xflip_tiles);
+  printf("yflip tiles:          %d\n", model->yflip_tiles);
+  printf("rotate tiles:         %d\n", model->rotate_tiles);
+  printf("tile count:           %d\n", model->tile_cnt);
   printf("\n");
   printf("output image:         %s\n", output_image);
-  printf("output size:          %dx%d\n", wfc->output_width, wfc->output_height);
-  printf("cell count:           %d\n", wfc->cell_cnt);
+  printf("output size:          %dx%d\n", output_width, output_height);
+  printf("cell count:           %d\n", output_width * output_height);
   printf("\n");
 }
 
@@ -86,6 +89,16 @@ Following options are available:\n\n\
   -x 0|1, --xflip=0|1                 Add horizontal flips of all tiles\n\
   -y 0|1, --yflip=0|1                 Add vertical flips of all tiles\n\
   -r 0|1, --rotate=0|1                Add n*90deg rotations of all tiles\n\
+  -s num, --seed=num                  Random seed, current time by default\n\
+  -n num, --count=num                 Number of outputs, saved as output_N.ext\n\
+  -t num, --threads=num               Threads used to build the rules and generate outputs\n\
+  -a num, --attempts=num              Race up to num seeds, keep the first success\n\
+  -b num, --backtracks=num            Backtracks on contradictions before giving up,\n\
+                                      not with -n or -a\n\
+  -B num, --backtrack-depth=num       Latest collapses that can be undone, 0 for all\n\
+  --rules-cache=DIR                   Load rules from DIR, or save them there\n\
+  --stats                             Print counters and timings of the run,\n\
+                                      not with -n or -a\n\
 \n\
 ");
 
@@ -147,8 +160,46 @@ int arg_num(int argc, const char **argv, int *i, const char *short_name, const c
   }
 }
 
+int arg_str(int argc, const char **argv, int *i, const char *long_name, const char **str)
+{
+  char name[128];
+  size_t len;
+
+  sprintf(name, "--%s", long_name);
+  len = strlen(name);
+  if (strcmp(argv[*i], name)==0) {
+    (*i)++;
+    if (*i==argc) {
+      usage(argv[0], EXIT_FAILURE);
+    }
+    *str = argv[*i];
+    (*i)++;
+    return 0;
+  } else if (strncmp(argv[*i], name, len)==0 && argv[*i][len]=='=') {
+    *str = argv[*i] + len + 1;
+    (*i)++;
+    return 0;
+  }
+
+  return -1;
+}
+
+int arg_flag(const char **argv, int *i, const char *long_name, int *flag)
+{
+  char name[128];
+
+  sprintf(name, "--%s", long_name);
+  if (strcmp(argv[*i], name)==0) {
+    (*i)++;
+    *flag = 1;
+    return 0;
+  }
+
+  return -1;
+}
+
 // Can terminate the program if the arguments are incorrect
-void read_args(int argc, const char **argv, enum wfc__method *method, const char **input, const char **output, int *width, int *height, int *tile_width, int *tile_height, int *expand_image, int *xflip_tiles, int *yflip_tiles, int *rotate_tiles)
+void read_args(int argc, const char **argv, enum wfc__method *method, const char **input, const char **output, int *width, int *height, int *tile_width, int *tile_height, int *expand_image, int *xflip_tiles, int *yflip_tiles, int *rotate_tiles, int *seed, int *count, int *thread_cnt, int *attempt_cnt, int *backtrack_cnt, int *backtrack_depth, const char **rules_cache, int *stats)
 {
   if (argc<2) {
     usage(argv[0], EXIT_FAILURE);
@@ -167,6 +218,14 @@ void read_args(int argc, const char **argv, enum wfc__method *method, const char
     if (arg_num(argc, argv, &i, "x", "xflip", xflip_tiles) == 0) continue;
     if (arg_num(argc, argv, &i, "y", "yflip", yflip_tiles) == 0) continue;
     if (arg_num(argc, argv, &i, "r", "rotate", rotate_tiles) == 0) continue;
+    if (arg_num(argc, argv, &i, "s", "seed", seed) == 0) continue;
+    if (arg_num(argc, argv, &i, "n", "count", count) == 0) continue;
+    if (arg_num(argc, argv, &i, "t", "threads", thread_cnt) == 0) continue;
+    if (arg_num(argc, argv, &i, "a", "attempts", attempt_cnt) == 0) continue;
+    if (arg_num(argc, argv, &i, "b", "backtracks", backtrack_cnt) == 0) continue;
+    if (arg_num(argc, argv, &i, "B", "backtrack-depth", backtrack_depth) == 0) continue;
+    if (arg_str(argc, argv, &i, "rules-cache", rules_cache) == 0) continue;
+    if (arg_flag(argv, &i, "stats", stats) == 0) continue;
 
     if (i != argc-2)
       usage(argv[0], EXIT_FAILURE);
@@ -174,6 +233,10 @@ void read_args(int argc, const char **argv, enum wfc__method *method, const char
     if (*method == 99999)
       usage(argv[0], EXIT_FAILURE);
 
+    // Backtracking and statistics apply to single runs only
+    if ((*count > 1 || *attempt_cnt > 1) && (*backtrack_cnt != 0 || *backtrack_depth != 0 || *stats))
+      usage(argv[0], EXIT_FAILURE);
+
     *input = argv[i];
     *output = argv[i+1];
     return;
@@ -181,6 +244,119 @@ void read_args(int argc, const char **argv, enum wfc__method *method, const char
 
 }
 
+// Inserts _idx before the extension of filename
+void indexed_filename(char *dst, size_t size, const char *filename, int idx)
+{
+  const char *extension = strrchr(filename, '.');
+  if (extension == NULL)
+    extension = filename + strlen(filename);
+
+  snprintf(dst, size, "%.*s_%d%s", (int)(extension - filename), filename, idx, extension);
+}
+
+// Loads the model from the rules cache directory, or builds it and saves
+// it there
+//
+// Return NULL on error
+struct wfc_model *create_model_cached(const char *rules_cache, struct wfc_image *image, int tile_width, int tile_height,
+                                      int expand_input, int xflip_tiles, int yflip_tiles, int rotate_tiles, int thread_cnt)
+{
+  char filename[4096];
+  unsigned long long key = wfc_model_key(image, tile_width, tile_height, expand_input,
+                                         xflip_tiles, yflip_tiles, rotate_tiles);
+  snprintf(filename, sizeof(filename), "%s/%016llx.wfcm", rules_cache, key);
+
+  struct wfc_model *model = wfc_model_load(filename, key);
+  if (model != NULL) {
+    printf("rules cache:          %s (loaded)\n", filename);
+    return model;
+  }
+
+  model = wfc_model_overlapping(image, tile_width, tile_height, expand_input,
+                                xflip_tiles, yflip_tiles, rotate_tiles, thread_cnt);
+  if (model == NULL)
+    return NULL;
+
+  if (wfc_model_save(model, key, filename))
+    printf("rules cache:          %s (saved)\n", filename);
+  else
+    p("Warning: cannot save rules: %s\n", filename);
+  return model;
+}
+
+void print_stats(struct wfc *wfc)
+{
+  struct wfc_stats stats;
+  wfc_stats(wfc, &stats);
+
+  printf("\n");
+  printf("tiles time:           %.3f ms\n", stats.tiles_ns / 1e6);
+  printf("rules time:           %.3f ms\n", stats.rules_ns / 1e6);
+  printf("collapses:            %lld\n", stats.collapse_cnt);
+  printf("props:                %lld\n", stats.prop_cnt);
+  printf("props skipped:        %lld\n", stats.prop_skip_cnt);
+  printf("tiles banned:         %lld\n", stats.ban_cnt);
+  printf("contradictions:       %lld\n", stats.contradiction_cnt);
+  printf("next cell time:       %.3f ms\n", stats.next_cell_ns / 1e6);
+  printf("propagation time:     %.3f ms\n", stats.propagate_ns / 1e6);
+  printf("cells memory:         %zu bytes\n", stats.cell_bytes);
+  printf("props memory:         %zu bytes\n", stats.prop_bytes);
+  printf("rules memory:         %zu bytes\n", stats.rule_bytes);
+  printf("backtracking memory:  %zu bytes\n", stats.backtrack_bytes);
+}
+
+void print_progress(void *user_data, int collapsed_cell_cnt, int cell_cnt)
+{
+  (void)user_data;
+  (void)cell_cnt;
+  printf("\rcells collapsed:      %d", collapsed_cell_cnt);
+  fflush(stdout);
+}
+
+// Generates count outputs on thread_cnt threads and saves them as
+// output_0.ext, output_1.ext, ...
+//
+// Return the number of saved outputs
+int export_batch(struct wfc_model *model, int width, int height, int count, int thread_cnt, unsigned int seed, const char *output_filename)
+{
+  unsigned int *seeds = NULL;
+  struct wfc_image **outputs = NULL;
+  if (count <= 0)
+    return 0;
+
+  seeds = malloc(sizeof(*seeds) * count);
+  outputs = malloc(sizeof(*outputs) * count);
+  if (seeds == NULL || outputs == NULL) {
+    free(seeds);
+    free(outputs);
+    return 0;
+  }
+
+  for (int i=0; i<count; i++)
+    seeds[i] = seed + i;
+
+  wfc_run_batch(model, width, height, count, seeds, thread_cnt, outputs);
+
+  int saved_cnt = 0;
+  for (int i=0; i<count; i++) {
+    char filename[1024];
+    indexed_filename(filename, sizeof(filename), output_filename, i);
+
+    if (outputs[i] == NULL) {
+      printf("%s: contradiction occurred (seed %u)\n", filename, seeds[i]);
+    } else if (!wfc_img_save(outputs[i], filename)) {
+      printf("%s: cannot save image\n", filename);
+    } else {
+      saved_cnt++;
+    }
+    wfc_img_destroy(outputs[i]);
+  }
+
+  free(seeds);
+  free(outputs);
+  return saved_cnt;
+}
+
 int main(int argc, const char **argv)
 {
   enum wfc__method method;
@@ -194,6 +370,14 @@ int main(int argc, const char **argv)
   int xflip_tiles = 1;
   int yflip_tiles = 1;
   int rotate_tiles = 1;
+  int seed = -1;
+  int count = 1;
+  int thread_cnt = 1;
+  int attempt_cnt = 1;
+  int backtrack_cnt = 0;
+  int backtrack_depth = 0;
+  const char *rules_cache = NULL;
+  int stats = 0;
 
   read_args(argc,
             argv,
@@ -207,7 +391,15 @@ int main(int argc, const char **argv)
             &expand_input,
             &xflip_tiles,
             &yflip_tiles,
-            &rotate_tiles);
+            &rotate_tiles,
+            &seed,
+            &count,
+            &thread_cnt,
+            &attempt_cnt,
+            &backtrack_cnt,
+            &backtrack_depth,
+            &rules_cache,
+            &stats);
 
   struct wfc_image *image = wfc_img_load(input_filename);
   if (image == NULL) {
@@ -215,25 +407,106 @@ int main(int argc, const char **argv)
     return EXIT_FAILURE;
   }
 
-  struct wfc *wfc = wfc_overlapping(output_width,
-                                    output_height,
-                                    image,
-                                    tile_width,
-                                    tile_height,
-                                    expand_input,
-                                    xflip_tiles,
-                                    yflip_tiles,
-                                    rotate_tiles);
+  struct wfc *wfc = NULL;
+  struct wfc_model *model;
+  if (rules_cache != NULL) {
+    model = create_model_cached(rules_cache,
+                                image,
+                                tile_width,
+                                tile_height,
+                                expand_input,
+                                xflip_tiles,
+                                yflip_tiles,
+                                rotate_tiles,
+                                thread_cnt);
+  } else {
+    model = wfc_model_overlapping(image,
+                                  tile_width,
+                                  tile_height,
+                                  expand_input,
+                                  xflip_tiles,
+                                  yflip_tiles,
+                                  rotate_tiles,
+                                  thread_cnt);
+  }
+
+  if (model == NULL) {
+    p("Error: cannot create wfc\n");
+    wfc_img_destroy(image);
+    return EXIT_FAILURE;
+  }
+
+  unsigned int run_seed = seed != -1 ? (unsigned int)seed : (unsigned int)time(NULL);
+
+  /* wfc_export_tiles(wfc, "tmp"); */
+  print_summary(model, image, run_seed, output_width, output_height, input_filename, output_filename);
+
+  // Batches and races create states of their own
+  if (count > 1) {
+    printf("output count:         %d\n", count);
+    printf("threads:              %d\n\n", thread_cnt);
+
+    int saved_cnt = export_batch(model, output_width, output_height,
+                                 count, thread_cnt, run_seed, output_filename);
+    printf("saved outputs:        %d\n", saved_cnt);
+
+    wfc_img_destroy(image);
+    wfc_model_destroy(model);
+    return saved_cnt == count ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (attempt_cnt > 1) {
+    printf("attempts:             %d\n", attempt_cnt);
+    printf("threads:              %d\n\n", thread_cnt);
+
+    unsigned int winning_seed;
+    struct wfc_image *output_image = wfc_run_race(model, output_width, output_height,
+                                                  run_seed, attempt_cnt, thread_cnt, &winning_seed);
+    wfc_model_destroy(model);
+    if (output_image == NULL) {
+      p("Contradiction occurred in all attempts, try again\n");
+      goto CLEANUP;
+    }
+    printf("winning seed:         %u\n", winning_seed);
 
+    int saved = wfc_img_save(output_image, output_filename);
+    wfc_img_destroy(output_image);
+    if (!saved) {
+      p("Error: cannot save image: %s\n", output_filename);
+      goto CLEANUP;
+    }
+
+    wfc_img_destroy(image);
+    return EXIT_SUCCESS;
+  }
+
+  wfc = malloc(sizeof(*wfc));
   if (wfc == NULL) {
+    p("Error: cannot create wfc\n");
+    wfc_model_destroy(model);
+    goto CLEANUP;
+  }
+  wfc->image = image;
+  wfc->model = model;
+  wfc->state = wfc_state_create(model, output_width, output_height);
+  if (wfc->state == NULL) {
     p("Error: cannot create wfc\n");
     goto CLEANUP;
   }
 
-  /* wfc_export_tiles(wfc, "tmp"); */
-  print_summary(wfc, input_filename, output_filename);
+  wfc->state->max_backtrack_cnt = backtrack_cnt;
+  wfc->state->backtrack_depth = backtrack_depth;
+  wfc_init_seed(wfc, run_seed);
+
+  wfc_set_progress(wfc, print_progress, NULL);
+  int rv = wfc_run(wfc, -1);
+  printf("\n");
+  if (backtrack_cnt > 0)
+    printf("backtracks:           %d\n", wfc->state->backtrack_cnt);
+  if (stats)
+    print_stats(wfc);
 
-  if (!wfc_run(wfc, -1)) {
+  if (!rv) {
     p("Contradiction occurred, try again\n");
     goto CLEANUP;
   }